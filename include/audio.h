@@ -0,0 +1,80 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdbool.h>
+
+#include "util.h"
+
+enum {
+    AUDIO_RATE = 44100,
+    AUDIO_CHANNELS = 1,
+};
+
+/* Decoded audio in the format of the sink, i.e. interleaved signed 16-bit samples */
+typedef struct {
+    i16* samples;
+    size frames;
+} pcm;
+
+typedef enum {
+    AUDIO_PULSE,  // Decoded in-process and played through PulseAudio (default)
+    AUDIO_NULL,   // Decoded in-process and discarded, for testing
+    AUDIO_FFPLAY, // Played by an ffplay process per file
+} audio_backend;
+
+/*
+ * Returns: The backend chosen by the environment variable JPPRON_AUDIO,
+ *          which is one of "pulse", "null" or "ffplay"
+ */
+audio_backend audio_get_backend(void);
+
+/*
+ * Decodes the audio file at @path into the format of the sink.
+ *
+ * Returns: The decoded audio, which needs to be freed with pcm_free().
+ *          @samples is NULL on failure.
+ */
+pcm audio_decode(const char* path);
+void pcm_free(pcm* p);
+
+/*
+ * Plays @p and returns once it has been played. The sink is opened on first
+ * use and kept open until audio_close().
+ */
+void audio_play(pcm p);
+
+/*
+ * Queues @p on the sink and returns as soon as it has been buffered, so that
+ * consecutive calls play back-to-back. audio_drain() waits for the end.
+ *
+ * Returns: false if the audio could not be written
+ */
+bool audio_write(pcm p);
+void audio_drain(void);
+void audio_close(void);
+
+/*
+ * Decodes a list of files in order in a background thread, so that the next
+ * file is ready by the time the current one has been played.
+ */
+typedef struct audio_prefetch audio_prefetch;
+
+/*
+ * Starts decoding the @n files in @paths. If @keys is given, files are taken
+ * from and added to the pcmcache under the corresponding key. Both are copied.
+ */
+audio_prefetch* audio_prefetch_start(char** paths, s8* keys, size n);
+
+/*
+ * Returns: The next file in order, blocking until it has been decoded.
+ *          Needs to be freed with pcm_free(). @samples is NULL if it could
+ *          not be decoded or all files have been returned.
+ */
+pcm audio_prefetch_next(audio_prefetch* pf);
+
+/*
+ * Stops decoding and frees everything not yet returned.
+ */
+void audio_prefetch_free(audio_prefetch* pf);
+
+#endif
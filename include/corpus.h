@@ -0,0 +1,37 @@
+#include <stdbool.h>
+
+#include "util.h"
+
+/*
+ * A synthetic audio directory in the ajt format, for benchmarks and tests
+ * at any scale. The same parameters always give the same corpus.
+ */
+typedef struct {
+    size sources;
+    size headwords;       // Per source
+    i32 max_files;        // Each headword has 1 to max_files files
+    i32 min_morae;        // Of the readings, at most CORPUS_MAX_MORAE
+    i32 max_morae;
+    i32 shared_percent;   // Headwords every source has, with their own files
+    i32 katakana_percent; // Files with a reading in katakana
+    bool media;           // Write a placeholder audio file for every file
+    u64 seed;
+} corpus_params;
+
+enum {
+    CORPUS_MAX_MORAE = 32,
+};
+
+/*
+ * Returns: The parameters of a small corpus, to be adjusted by the caller
+ */
+corpus_params corpus_defaults(void);
+
+/*
+ * Writes the sources "source000", "source001", .. with an index.json each
+ * into the existing directory @dir. The placeholder media files are 10 ms
+ * of silence as WAV.
+ *
+ * Returns: The number of headword and file records written
+ */
+size write_corpus(const char* dir, corpus_params p);
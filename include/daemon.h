@@ -0,0 +1,41 @@
+#include <stdbool.h>
+
+#include "util.h"
+
+/*
+ * A request is the argument list of the client, each argument terminated
+ * by a NUL byte, followed by a shutdown of the writing side. The client's
+ * stderr is passed along with the first byte as SCM_RIGHTS. The reply is
+ * the standard output of the request, followed by a NUL byte and the exit
+ * status, until the daemon closes the connection. A reply without the
+ * status means the daemon exited while handling the request.
+ */
+
+/*
+ * Returns: The exit status of the request, which is sent to the client
+ */
+typedef int (*daemon_handler)(int argc, char** argv, void* user_data);
+
+/*
+ * Returns: The path of the daemon socket in the user runtime directory.
+ *          Needs to be freed.
+ */
+s8 daemon_socket_path(void);
+
+/*
+ * Listens on @sockpath and calls @handler with the arguments of every
+ * client request, one request at a time. What the handler writes to stdout
+ * is sent to the client and what it writes to stderr to the client's stderr.
+ *
+ * Only returns if the socket could not be set up.
+ */
+void daemon_serve(const char* sockpath, daemon_handler handler, void* user_data);
+
+/*
+ * Sends @argv to the daemon listening on @sockpath and copies its reply
+ * to stdout. The daemon writes errors to our stderr itself. @status is set to the exit status of the request, which is
+ * EXIT_FAILURE if the daemon did not finish it.
+ *
+ * Returns: false if no daemon is listening, true otherwise
+ */
+bool daemon_forward(const char* sockpath, int argc, char** argv, int* status);
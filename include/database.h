@@ -6,13 +6,188 @@ typedef struct {
   size len;
 } data_s;
 
-void opendb(const char* path, bool write);
+typedef struct {
+  s8 name;     // e.g. NHK日本語発音アクセント新辞典
+  s8 dir;      // Directory of the source below the audio directory
+  s8 mediadir; // Directory of the audio files below dir
+} source;
+
+typedef enum {
+  DB_READONLY,
+  DB_CREATE, // Empties the database, see jppron_create()
+  DB_UPDATE, // Keeps the contents, see jppron_refresh()
+} dbmode;
+
+/*
+ * The state of the index file of a source directory when it was indexed
+ */
+typedef struct {
+  u8 id;     // Source id of its records
+  i64 mtime; // Modification time of index.json in nanoseconds, 0 if there is none
+  i64 size;  // Size of index.json
+  u64 hash;  // FNV-1a of index.json
+} sourcemeta;
+
+typedef struct {
+  s8 headword;
+  s8 fileref;
+} readingentry;
+
+typedef struct {
+  s8 headword;
+  s8 reading;
+  u8 pitch;
+  u8 morae;
+  s8 fileref;
+} pitchentry;
+
+/*
+ * Returns: false to stop the iteration
+ */
+typedef bool (*pitch_callback)(pitchentry e, void* user_data);
+
+/*
+ * Returns: false to stop the iteration
+ */
+typedef bool (*headword_callback)(s8 headword, void* user_data);
+
+void opendb(const char* path, dbmode mode);
 void closedb(void);
+/*
+ * Copies the database at @path into the empty directory @dstdir
+ */
+void copydb(const char* path, const char* dstdir);
+/*
+ * Commits the changes so far and writes a compacted copy of the database,
+ * which has to be opened for writing, into the empty directory @dstdir
+ */
+void compactdb(const char* dstdir);
+/*
+ * The database is rebuilt on the side and renamed into place, see
+ * jppron_create(). A database opened read-only keeps reading the file it
+ * opened.
+ *
+ * Returns: true if the data file of the read-only database has been replaced
+ *          since it was opened
+ */
+bool dbreplaced(void);
 /*
  * Add to database, allowing duplicates if they are added directly after another
  */
 void addtodb1(s8 key, s8 val);
 void addtodb2(s8 key, s8 val);
+/*
+ * Adds @val to the values of @key unless it is one of them already
+ */
+void inserttodb1(s8 key, s8 val);
+/*
+ * The reading index maps the key readingkey(@reading, @headword) to the file
+ * references of @headword with the hiragana reading @reading. Sharing the
+ * reading as prefix, all headwords of a reading are next to each other.
+ *
+ * Returns: The key, which needs to be freed
+ */
+s8 readingkey(s8 reading, s8 headword);
+void appendreading(s8 key, s8 fileref); // See appendtodb1()
+void insertreading(s8 key, s8 fileref); // See inserttodb1()
+/*
+ * The pitch index maps @pitch, @morae and readingkey(@reading, @headword) to
+ * the file references with that pitch accent, so that the words of a pitch
+ * and mora count are next to each other.
+ *
+ * Returns: The key, which needs to be freed
+ */
+s8 pitchkey(u8 pitch, u8 morae, s8 reading, s8 headword);
+void appendpitch(s8 key, s8 fileref);
+void insertpitch(s8 key, s8 fileref);
+/*
+ * Faster versions of the above for bulk loading. Keys have to be passed in
+ * ascending dbcmp order and for addtodb1 the values of a key as well.
+ */
+void appendtodb1(s8 key, s8 val);
+void appendtodb2(s8 key, s8 val);
+/*
+ * The table of sources (audio directories), which records refer to by id.
+ * getsource() is available as soon as the database is opened read-only.
+ */
+void addsource(u8 id, source src);
+source getsource(u8 id);
+/*
+ * Deletes the @n sources @ids and all of their records, with a single walk
+ * through each db that is not keyed by source
+ */
+void deletesources(const u8* ids, size n);
+/*
+ * The metadata of the source directories by name, which is only available
+ * when opened for writing.
+ */
+bool getsourcemeta(s8 dir, sourcemeta* meta);
+void putsourcemeta(s8 dir, sourcemeta meta);
+void delsourcemeta(s8 dir);
+/*
+ * Returns: The names of all source directories with metadata, which need to
+ *          be freed with frees8buffer()
+ */
+s8* getmetadirs(void);
+/*
+ * Reads the metadata of all sources of the database at @path without
+ * opening it, see jppron_refresh(). The results are appended to @dirs, which
+ * needs to be freed with frees8buffer(), and @metas.
+ *
+ * Returns: The number of sources, or -1 if the database has no metadata
+ *          (or would lose it on opening it for writing)
+ */
+size readsourcemetas(const char* path, s8** dirs, sourcemeta** metas);
+/*
+ * Compares two keys or values in the order they are stored in the database
+ */
+i32 dbcmp(s8 a, s8 b);
 
+/*
+ * A lookup session on a database opened read-only. All get functions have to
+ * be called between beginlookup() and endlookup(), which share one read
+ * transaction. The returned strings point into the database map and are
+ * only valid until endlookup().
+ */
+void beginlookup(void);
+void endlookup(void);
+
+/*
+ * Every source's files are stored, but only those of the source with the
+ * directory name sorting first are returned.
+ *
+ * Returns: A buffer with the files of @key, which needs to be freed with buf_free()
+ */
 s8* getfiles(s8 key);
+/*
+ * Returns: A buffer with the files of @headword with the reading @reading,
+ *          restricted to one source like getfiles(). Needs to be freed
+ *          with buf_free().
+ */
+s8* getfilesbyreading(s8 headword, s8 reading);
+/*
+ * Returns: A buffer with the files of all headwords with the reading
+ *          @reading from every source, sorted by headword. Needs to be
+ *          freed with buf_free().
+ */
+readingentry* getreadingentries(s8 reading);
+/*
+ * Calls @cb with every file of pitch @pitch and @morae morae, or any number
+ * of morae if @morae is negative, in order of reading and headword. The
+ * entries point into the database like the other results.
+ */
+void getpitchentries(u8 pitch, i32 morae, pitch_callback cb, void* user_data);
+/*
+ * Calls @cb with the headwords starting with @prefix in dbcmp() order,
+ * skipping the first @offset of them and stopping after @limit, unless it
+ * is 0. Like getpitchentries(), the database is walked as they are passed.
+ */
+void getheadwords(s8 prefix, size offset, size limit, headword_callback cb, void* user_data);
+/*
+ * Checks which of the @n @keys have files. The keys need to be sorted with
+ * dbcmp(), so that a single cursor can walk through them in order.
+ *
+ * Stores the result for @keys[i] in @found[i].
+ */
+void haskeys(s8* keys, size n, bool* found);
 s8 getfromdb2(s8 key);
@@ -1,18 +1,69 @@
+#include <stdbool.h>
+
 #include "util.h"
 
+typedef struct {
+    s8 word;
+    i32 parent; // Index of the candidate @word was derived from, -1 for the input
+    i32 rule;   // The rule applied to the parent, -1 for the input
+    i32 depth;  // Number of rules applied to the input
+} deinflection;
+
+typedef struct {
+    deinflection* items;
+    size len;
+} deinflections;
+
 /*
  * @word: The japanese word to be deinflected
+ * @a: The arena all results are allocated from. 64 KiB are plenty for a
+ *     single word. Once @a is exhausted no more candidates are added, and
+ *     if it cannot hold the bookkeeping of about 10 KiB there are none.
  *
- * Contains all intermediate steps, e.g. してしまった -> してしまう, して, する
+ * Contains all intermediate steps, e.g. してしまった -> してしまう, して, する.
+ * Every candidate appears only once, reached by the shortest rule chain that
+ * is found first. Following @parent gives the chain of rules applied. The
+ * first candidate is @word itself if there are any.
  *
- * Returns: A null terminated array with possible deinflections. Array needs to be freed with g_strfreev() for example.
+ * Reentrant, the rule trie is built once on first use and only read afterwards.
+ *
+ * Returns: The candidates, which are valid as long as @a is
  */
-s8* deinflect(s8 word);
+deinflections deinflect(s8 word, arena* a);
 
 /*
- * Tries to give a hiragana conversion of @input using MeCab.
+ * Returns: The ending (or beginning) of a word that rule @rule of a deinflection replaces
+ */
+s8 deinflect_rule_pattern(i32 rule);
+
+/*
+ * Tries to give a hiragana conversion of @input using MeCab. The tagger is
+ * created on first use and kept, recent results are cached. Thread-safe.
  *
- * Returns: A newly allocated string containing the conversion.
+ * Returns: A newly allocated string containing the conversion, which is
+ *          empty if MeCab is not available
+ */
+s8 kanji2hira(s8 input);
+/*
+ * Like kanji2hira() for each of the @n @words, storing the results in
+ * @readings, but taking the tagger only once.
+ */
+void kanji2hira_batch(s8* words, size n, s8* readings);
+/*
+ * Converts all katakana in @s to hiragana in place. Only the first @s.len
+ * bytes are looked at, @s does not need to be null-terminated.
+ */
+void kata2hira_inplace(s8 s);
+/*
+ * Returns: true if @s contains katakana which kata2hira_inplace() would convert
+ */
+bool has_katakana(s8 s);
+/*
+ * Returns: The number of morae of the kana in @kana. Small ゃゅょ and vowels
+ *          belong to the kana before them, っ, ん and ー count on their own.
+ */
+i32 count_morae(s8 kana);
+/*
+ * Returns: A converted copy of @kata_in, see kata2hira_inplace(), which needs to be freed
  */
-char* kanji2hira(s8 input);
 s8 kata2hira(s8 kata_in);
@@ -0,0 +1,48 @@
+#include <stdbool.h>
+
+#include "util.h"
+#include "audio.h"
+
+/*
+ * A cache of decoded audio, keyed by the file references of the database.
+ *
+ * The least recently used entries are kept in memory, up to JPPRON_CACHE_MB
+ * megabytes (default 64, 0 disables it). If JPPRON_DISK_CACHE_MB is set,
+ * decoded audio is also appended to a cache file of up to that size, which is
+ * mapped on the next start. Processes sharing the file append under flock().
+ * File references are only valid for one build of the database, so the cache
+ * file has to be removed when rebuilding it.
+ */
+typedef struct {
+    size mem_hits;
+    size disk_hits;
+    size misses;
+    size entries;     // In memory
+    size bytes;       // In memory
+    size max_bytes;
+    size disk_entries; // Mapped from the cache file
+    size disk_bytes;   // Size of the cache file
+} pcmcache_stats;
+
+/*
+ * Enables the cache. @diskpath is the cache file, which is only used if the
+ * disk cache is enabled and can be NULL otherwise.
+ */
+void pcmcache_open(const char* diskpath);
+void pcmcache_close(void);
+
+/*
+ * Looks up @key and stores a copy of the audio in @out, which needs to be
+ * freed with pcm_free().
+ *
+ * Returns: true on a hit
+ */
+bool pcmcache_get(s8 key, pcm* out);
+
+/*
+ * Stores a copy of @p under @key. Thread-safe like pcmcache_get().
+ */
+void pcmcache_put(s8 key, pcm p);
+
+pcmcache_stats pcmcache_get_stats(void);
+void pcmcache_print_stats(void);
@@ -51,6 +51,9 @@ PDJSON_SYMEXPORT enum json_type json_next(json_stream *json);
 PDJSON_SYMEXPORT enum json_type json_peek(json_stream *json);
 PDJSON_SYMEXPORT void json_reset(json_stream *json);
 PDJSON_SYMEXPORT char *json_get_string(json_stream *json, size_t *length);
+/* Like json_get_string, but neither copies nor terminates the string.
+ * For buffer sources, strings without escapes point into the buffer. */
+PDJSON_SYMEXPORT const char *json_get_slice(json_stream *json, size_t *length);
 PDJSON_SYMEXPORT double json_get_number(json_stream *json);
 
 PDJSON_SYMEXPORT enum json_type json_skip(json_stream *json);
@@ -101,6 +104,8 @@ struct json_stream {
         char *string;
         size_t string_fill;
         size_t string_size;
+        const char *slice;
+        size_t slice_len;
     } data;
 
     size_t ntokens;
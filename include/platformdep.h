@@ -1 +1,16 @@
+#include <stddef.h>
+
+/*
+ * Plays the audio file at @filepath with the backend chosen by
+ * audio_get_backend() and returns once it has been played.
+ */
 void play_audio(int len, char filepath[len]);
+
+/*
+ * Maps the file at @path read-only into memory and stores its size in @len.
+ *
+ * Returns: The contents of the file, or NULL on failure with errno set.
+ *          Needs to be released with unmap_file().
+ */
+char* map_file(const char* path, size_t* len);
+void unmap_file(char* map, size_t len);
@@ -0,0 +1,58 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+
+#include "util.h"
+
+/*
+ * Timers and counters of the phases of a lookup, reported by --stats.
+ *
+ * Only compiled in with -DJPPRON_STATS (the default, see the Makefile).
+ * Without it STATS_START() and STATS_STOP() expand to nothing and
+ * stats_print() only says so. The counters are updated with relaxed atomics,
+ * since the index workers and the audio prefetch thread record as well.
+ */
+typedef enum {
+    STAT_DB_OPEN,
+    STAT_TXN_BEGIN,
+    STAT_CURSOR_WALK,   // getfiles() and friends
+    STAT_RECORD_DECODE, // getfileinfo()
+    STAT_KATA2HIRA,
+    STAT_KANJI2HIRA,    // MeCab
+    STAT_AUDIO_DECODE,
+    STAT_AUDIO_SPAWN,   // ffplay
+    STAT_JSON_PARSE,    // One index.json
+    STAT_COUNT
+} stat_id;
+
+typedef struct {
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+} stat_counter;
+
+typedef struct {
+    stat_counter c[STAT_COUNT];
+} stats_snapshot;
+
+#ifdef JPPRON_STATS
+#define STATS_START(t) u64 t = stats_now()
+#define STATS_STOP(id, t) stats_add(id, stats_now() - (t))
+#else
+#define STATS_START(t) ((void)0)
+#define STATS_STOP(id, t) ((void)0)
+#endif
+
+u64 stats_now(void);
+void stats_add(stat_id id, u64 ns);
+
+stats_snapshot stats_get(void);
+
+/*
+ * Prints the counters as a table, or as a JSON object if @json is set. If
+ * @since is not NULL, only what was recorded after it was taken.
+ */
+void stats_print(const stats_snapshot* since, bool json);
+
+#endif
@@ -8,9 +8,12 @@
 #include "buf.h" // Growable buffer implementation
 
 typedef uint8_t    u8;
+typedef int16_t    i16;
 typedef int32_t    i32;
 typedef signed int b32;
 typedef uint32_t   u32;
+typedef int64_t    i64;
+typedef uint64_t   u64;
 typedef ptrdiff_t  size;
 
 #ifdef DEBUG
@@ -76,6 +79,28 @@ typedef struct s8 {
     size len;
 } s8;
 
+/*
+ * A bump allocator over the memory between @beg and @end, which is owned by
+ * the caller. Everything allocated from it is released at once by
+ * restoring @beg or by releasing the underlying memory.
+ */
+typedef struct {
+    u8* beg;
+    u8* end;
+} arena;
+
+/*
+ * Returns zeroed memory for @count objects of @objsize bytes from @a and
+ * aborts if @a is exhausted.
+ */
+void* arena_alloc(arena* a, size objsize, size align, size count);
+#define anew(a, type, num) (type*)arena_alloc(a, sizeof(type), _Alignof(type), num)
+/*
+ * Like arena_alloc(), but returns NULL if @a is exhausted
+ */
+void* arena_tryalloc(arena* a, size objsize, size align, size count);
+#define tryanew(a, type, num) (type*)arena_tryalloc(a, sizeof(type), _Alignof(type), num)
+
 void u8copy(u8 *dst, u8 *src, size n);
 i32 u8compare(u8 *a, u8 *b, size n);
 /*
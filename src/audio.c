@@ -0,0 +1,331 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+#include <pulse/error.h>
+#include <pulse/simple.h>
+
+#include "util.h"
+#include "audio.h"
+#include "pcmcache.h"
+#include "stats.h"
+
+// Short enough to start playing right away, long enough to not underrun
+#define PULSE_TARGET_LATENCY_USEC 50000
+
+static pa_simple* pulse = 0;
+
+audio_backend
+audio_get_backend(void)
+{
+    const char* env = getenv("JPPRON_AUDIO");
+    if (!env || !*env || strcmp(env, "pulse") == 0)
+	return AUDIO_PULSE;
+    if (strcmp(env, "null") == 0)
+	return AUDIO_NULL;
+    if (strcmp(env, "ffplay") == 0)
+	return AUDIO_FFPLAY;
+
+    error_msg("Unknown audio backend '%s'. Using pulse..", env);
+    return AUDIO_PULSE;
+}
+
+void
+pcm_free(pcm* p)
+{
+    free(p->samples);
+    *p = (pcm){ 0 };
+}
+
+/*
+ * Appends everything the decoder has ready to @out, resampled by @swr.
+ * Without @frame the resampler is flushed instead.
+ */
+static bool
+append_frames(SwrContext* swr, AVFrame* frame, pcm* out, size* cap)
+{
+    int in_frames = frame ? frame->nb_samples : 0;
+    int max_out = swr_get_out_samples(swr, in_frames);
+    if (max_out < 0)
+	return false;
+
+    if (out->frames + max_out > *cap)
+    {
+	*cap = 2 * *cap > out->frames + max_out ? 2 * *cap : out->frames + max_out;
+	out->samples = xrealloc(out->samples, (size_t)(*cap * AUDIO_CHANNELS) * sizeof(*out->samples));
+    }
+
+    u8* dst = (u8*)(out->samples + out->frames * AUDIO_CHANNELS);
+    int n = swr_convert(swr, &dst, max_out,
+			frame ? (const u8**)frame->extended_data : NULL, in_frames);
+    if (n < 0)
+	return false;
+    out->frames += n;
+    return true;
+}
+
+static bool
+receive_frames(AVCodecContext* dec, SwrContext* swr, AVFrame* frame, pcm* out, size* cap)
+{
+    int ret;
+    while ((ret = avcodec_receive_frame(dec, frame)) == 0)
+    {
+	bool ok = append_frames(swr, frame, out, cap);
+	av_frame_unref(frame);
+	if (!ok)
+	    return false;
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+}
+
+pcm
+audio_decode(const char* path)
+{
+    pcm out = { 0 };
+    size cap = 0;
+    bool ok = false;
+
+    AVFormatContext* fmt = 0;
+    AVCodecContext* dec = 0;
+    SwrContext* swr = 0;
+    AVPacket* pkt = 0;
+    AVFrame* frame = 0;
+
+    STATS_START(start);
+    av_log_set_level(AV_LOG_ERROR);
+
+    if (avformat_open_input(&fmt, path, NULL, NULL) < 0)
+    {
+	error_msg("Could not open audio file: %s", path);
+	goto cleanup;
+    }
+    if (avformat_find_stream_info(fmt, NULL) < 0)
+	goto cleanup;
+
+    const AVCodec* codec = 0;
+    int stream = av_find_best_stream(fmt, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (stream < 0)
+    {
+	error_msg("No audio stream in file: %s", path);
+	goto cleanup;
+    }
+
+    if (!(dec = avcodec_alloc_context3(codec))
+	|| avcodec_parameters_to_context(dec, fmt->streams[stream]->codecpar) < 0
+	|| avcodec_open2(dec, codec, NULL) < 0)
+    {
+	error_msg("Could not open the decoder for: %s", path);
+	goto cleanup;
+    }
+
+    AVChannelLayout out_layout;
+    av_channel_layout_default(&out_layout, AUDIO_CHANNELS);
+    if (swr_alloc_set_opts2(&swr, &out_layout, AV_SAMPLE_FMT_S16, AUDIO_RATE,
+			    &dec->ch_layout, dec->sample_fmt, dec->sample_rate, 0, NULL) < 0
+	|| swr_init(swr) < 0)
+    {
+	error_msg("Could not set up resampling for: %s", path);
+	goto cleanup;
+    }
+
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pkt || !frame)
+	fatal("Out of memory.");
+
+    while (av_read_frame(fmt, pkt) >= 0)
+    {
+	bool decoded = pkt->stream_index != stream
+		       || (avcodec_send_packet(dec, pkt) >= 0
+			   && receive_frames(dec, swr, frame, &out, &cap));
+	av_packet_unref(pkt);
+	if (!decoded)
+	{
+	    error_msg("Could not decode: %s", path);
+	    goto cleanup;
+	}
+    }
+
+    // Drain the decoder and the resampler
+    ok = avcodec_send_packet(dec, NULL) >= 0
+	 && receive_frames(dec, swr, frame, &out, &cap)
+	 && append_frames(swr, NULL, &out, &cap);
+
+cleanup:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    swr_free(&swr);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+
+    if (!ok || !out.frames)
+	pcm_free(&out);
+    STATS_STOP(STAT_AUDIO_DECODE, start);
+    return out;
+}
+
+static bool
+open_pulse(void)
+{
+    pa_sample_spec spec = {
+	.format = PA_SAMPLE_S16NE,
+	.rate = AUDIO_RATE,
+	.channels = AUDIO_CHANNELS,
+    };
+    pa_buffer_attr attr = {
+	.maxlength = (uint32_t)-1,
+	.tlength = (uint32_t)pa_usec_to_bytes(PULSE_TARGET_LATENCY_USEC, &spec),
+	.prebuf = (uint32_t)-1,
+	.minreq = (uint32_t)-1,
+	.fragsize = (uint32_t)-1,
+    };
+
+    int err = 0;
+    pulse = pa_simple_new(NULL, "jppron", PA_STREAM_PLAYBACK, NULL, "Pronunciation",
+			  &spec, NULL, &attr, &err);
+    if (!pulse)
+	error_msg("Could not connect to PulseAudio: %s", pa_strerror(err));
+    return pulse;
+}
+
+bool
+audio_write(pcm p)
+{
+    if (!p.samples || audio_get_backend() == AUDIO_NULL)
+	return true;
+    if (!pulse && !open_pulse())
+	return false;
+
+    int err = 0;
+    size_t bytes = (size_t)(p.frames * AUDIO_CHANNELS) * sizeof(*p.samples);
+    if (pa_simple_write(pulse, p.samples, bytes, &err) < 0)
+    {
+	error_msg("Could not play audio: %s", pa_strerror(err));
+
+	// Reconnect on the next call, e.g. after the server was restarted
+	audio_close();
+	return false;
+    }
+    return true;
+}
+
+void
+audio_drain(void)
+{
+    int err = 0;
+    if (pulse && pa_simple_drain(pulse, &err) < 0)
+    {
+	error_msg("Could not play audio: %s", pa_strerror(err));
+	audio_close();
+    }
+}
+
+void
+audio_play(pcm p)
+{
+    if (audio_write(p))
+	audio_drain();
+}
+
+void
+audio_close(void)
+{
+    if (pulse)
+	pa_simple_free(pulse);
+    pulse = 0;
+}
+
+struct audio_prefetch {
+    GThread* thread;
+    GAsyncQueue* decoded; // Of pcm*, in the order of @paths
+    char** paths;
+    s8* keys; // Of the pcmcache, NULL if not cached
+    size n;
+    size returned;
+    gint cancelled;
+};
+
+static gpointer
+prefetch_worker(gpointer data)
+{
+    audio_prefetch* pf = data;
+    for (size i = 0; i < pf->n && !g_atomic_int_get(&pf->cancelled); i++)
+    {
+	pcm* p = new(pcm, 1);
+	if (!pf->keys || !pcmcache_get(pf->keys[i], p))
+	{
+	    *p = audio_decode(pf->paths[i]);
+	    if (pf->keys)
+		pcmcache_put(pf->keys[i], *p);
+	}
+	g_async_queue_push(pf->decoded, p);
+    }
+    return NULL;
+}
+
+audio_prefetch*
+audio_prefetch_start(char** paths, s8* keys, size n)
+{
+    audio_prefetch* pf = new(audio_prefetch, 1);
+    pf->decoded = g_async_queue_new();
+    pf->paths = new(char*, n);
+    pf->keys = keys ? new(s8, n) : NULL;
+    pf->n = n;
+    for (size i = 0; i < n; i++)
+    {
+	pf->paths[i] = g_strdup(paths[i]);
+	if (keys)
+	    pf->keys[i] = s8dup(keys[i]);
+    }
+
+    pf->thread = g_thread_new("jppron-decode", prefetch_worker, pf);
+    return pf;
+}
+
+pcm
+audio_prefetch_next(audio_prefetch* pf)
+{
+    if (pf->returned == pf->n)
+	return (pcm){ 0 };
+
+    pcm* p = g_async_queue_pop(pf->decoded);
+    pf->returned++;
+    pcm ret = *p;
+    free(p);
+    return ret;
+}
+
+void
+audio_prefetch_free(audio_prefetch* pf)
+{
+    if (!pf)
+	return;
+
+    g_atomic_int_set(&pf->cancelled, 1);
+    g_thread_join(pf->thread);
+
+    pcm* p;
+    while ((p = g_async_queue_try_pop(pf->decoded)))
+    {
+	pcm_free(p);
+	free(p);
+    }
+    g_async_queue_unref(pf->decoded);
+
+    for (size i = 0; i < pf->n; i++)
+    {
+	g_free(pf->paths[i]);
+	if (pf->keys)
+	    frees8(&pf->keys[i]);
+    }
+    free(pf->paths);
+    free(pf->keys);
+    free(pf);
+}
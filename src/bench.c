@@ -0,0 +1,302 @@
+/*
+ * Benchmarks of the hot paths on a synthetic corpus, see `make bench`.
+ *
+ * Usage: jppron-bench [headwords per source [sources]]
+ *
+ * Every result is printed as a JSON object on its own line, so that runs
+ * of different versions can be compared by a script.
+ */
+#define _XOPEN_SOURCE 700 // nftw
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+
+// Built as one unit with jppron.c to reach its static functions
+#include "jppron.c"
+#include "corpus.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+enum {
+    PARSE_ROUNDS = 3,
+    WARM_LOOKUPS = 10000,
+    COLD_LOOKUPS = 200,
+    MIN_LOOP_NS = 500000000, // Of the loops measuring a rate
+};
+
+static u64
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+static void
+print_result_start(const char* name)
+{
+    printf("{\"bench\":\"%s\",\"version\":\"%s\"", name, BENCH_VERSION);
+}
+
+static int
+cmpu64(const void* a, const void* b)
+{
+    u64 x = *(const u64*)a, y = *(const u64*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Prints the percentiles of the @n latencies @ns in microseconds and ends
+ * the result
+ */
+static void
+print_latencies(u64* ns, size n)
+{
+    qsort(ns, (size_t)n, sizeof(*ns), cmpu64);
+    const double pcts[] = { 50, 90, 99 };
+    printf(",\"samples\":%td", n);
+    for (int i = 0; i < countof(pcts); i++)
+	printf(",\"p%.0f_us\":%.3f", pcts[i], n ? ns[(size)(pcts[i] / 100 * (n - 1))] / 1e3 : 0);
+    printf(",\"max_us\":%.3f}\n", n ? ns[n - 1] / 1e3 : 0);
+}
+
+/*
+ * add_from_index() on every source, best of PARSE_ROUNDS
+ */
+static void
+bench_parse(char* corpusdir)
+{
+    char** sources = list_sources(corpusdir);
+    u64 best = UINT64_MAX;
+    size bytes = 0, records = 0;
+
+    for (int round = 0; round < PARSE_ROUNDS; round++)
+    {
+	u64 elapsed = 0;
+	bytes = records = 0;
+	for (size i = 0; i < (size)buf_size(sources); i++)
+	{
+	    indexbatch* b = new_batch(corpusdir, sources[i], i);
+	    s8 index_path = buildpath(b->curdir, s8("index.json"));
+
+	    u64 start = now_ns();
+	    add_from_index((char*)index_path.s, b);
+	    elapsed += now_ns() - start;
+
+	    bytes += (size)b->maplen;
+	    records += (size)(buf_size(b->filenames) + buf_size(b->fileinfos));
+	    frees8(&index_path);
+	    free_batch(b);
+	}
+	best = MIN(best, elapsed);
+    }
+
+    print_result_start("parse");
+    printf(",\"bytes\":%td,\"records\":%td,\"seconds\":%.6f,\"mb_per_s\":%.2f,\"records_per_s\":%.0f}\n",
+	   bytes, records, best / 1e9, bytes / 1e6 / (best / 1e9), records / (best / 1e9));
+    free_sources(sources);
+}
+
+static void
+bench_build(char* corpusdir, s8 dbdir)
+{
+    u64 start = now_ns();
+    jppron_create(corpusdir, dbdir);
+    u64 elapsed = now_ns() - start;
+
+    s8 dbfile = buildpath(dbdir, s8("data.mdb"));
+    struct stat st = { 0 };
+    stat((char*)dbfile.s, &st);
+    frees8(&dbfile);
+
+    print_result_start("build");
+    printf(",\"seconds\":%.6f,\"db_bytes\":%lld}\n", elapsed / 1e9, (long long)st.st_size);
+}
+
+static bool
+collect_headword(s8 headword, void* user_data)
+{
+    s8** headwords = user_data;
+    buf_push(*headwords, s8dup(headword));
+    return true;
+}
+
+/*
+ * Returns: The time to look up @headword and decode the fileinfo of each
+ *          of its files
+ */
+static u64
+time_lookup(s8 headword)
+{
+    u64 start = now_ns();
+    beginlookup();
+    s8* files = getfiles(headword);
+    for (size_t i = 0; i < buf_size(files); i++)
+	getfileinfo(files[i]);
+    buf_free(files);
+    endlookup();
+    return now_ns() - start;
+}
+
+/*
+ * Evicts the pages of @path from the page cache
+ */
+static void
+drop_cached(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+	return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/*
+ * getfiles() and getfileinfo() of random headwords. Warm lookups reuse the
+ * open database, cold ones reopen it with the data file evicted from the
+ * page cache first and include the time to open it.
+ */
+static void
+bench_lookup(s8 dbdir)
+{
+    opendb((char*)dbdir.s, DB_READONLY);
+    s8* headwords = 0;
+    beginlookup();
+    getheadwords((s8){ 0 }, 0, 0, collect_headword, &headwords);
+    endlookup();
+
+    size n = (size)buf_size(headwords);
+    if (n == 0)
+	fatal("The benchmark database is empty.");
+
+    u64 seed = 42;
+    u64* ns = new(u64, WARM_LOOKUPS);
+    for (size i = 0; i < n; i++) // Warm up
+	time_lookup(headwords[i]);
+    for (size i = 0; i < WARM_LOOKUPS; i++)
+	ns[i] = time_lookup(headwords[(seed = seed * 6364136223846793005 + 1) % (u64)n]);
+    print_result_start("lookup_warm");
+    print_latencies(ns, WARM_LOOKUPS);
+
+    s8 dbfile = buildpath(dbdir, s8("data.mdb"));
+    for (size i = 0; i < COLD_LOOKUPS; i++)
+    {
+	s8 hw = headwords[(seed = seed * 6364136223846793005 + 1) % (u64)n];
+	closedb();
+	drop_cached((char*)dbfile.s);
+
+	u64 start = now_ns();
+	opendb((char*)dbdir.s, DB_READONLY);
+	ns[i] = now_ns() - start + time_lookup(hw);
+    }
+    print_result_start("lookup_cold");
+    print_latencies(ns, COLD_LOOKUPS);
+
+    closedb();
+    frees8(&dbfile);
+    free(ns);
+    frees8buffer(headwords);
+}
+
+static void
+bench_deinflect(void)
+{
+    static const char* const words[] = {
+	"食べなかった", "行きました", "読んでいる", "書かれる", "美しくない",
+	"してしまった", "来させられる", "静かでした", "飲みたくなかった", "見ている",
+    };
+    u8* mem = xmalloc(1 << 16);
+    arena a = { 0 };
+
+    size calls = 0, candidates = 0;
+    u64 start = now_ns(), elapsed;
+    do
+    {
+	for (int i = 0; i < countof(words); i++)
+	{
+	    a = (arena){ .beg = mem, .end = mem + (1 << 16) };
+	    candidates += deinflect(fromcstr_((char*)words[i]), &a).len;
+	}
+	calls += countof(words);
+    } while ((elapsed = now_ns() - start) < MIN_LOOP_NS);
+
+    print_result_start("deinflect");
+    printf(",\"calls\":%td,\"candidates\":%td,\"calls_per_s\":%.0f}\n", calls, candidates, calls / (elapsed / 1e9));
+    free(mem);
+}
+
+/*
+ * kata2hira_inplace() on 1 MiB of katakana text, including the copy that
+ * restores the input before every round
+ */
+static void
+bench_kata2hira(void)
+{
+    const size len = 1 << 20;
+    s8 kata = news8(len);
+    s8 work = news8(len);
+    s8 text = s8("カタカナのテキスト、ジッサイのヨミにチカいブン。");
+    for (size i = 0; i + text.len <= len; i += text.len)
+	u8copy(kata.s + i, text.s, text.len);
+    kata.len = len - len % text.len;
+
+    size bytes = 0;
+    u64 start = now_ns(), elapsed;
+    do
+    {
+	u8copy(work.s, kata.s, kata.len);
+	kata2hira_inplace((s8){ .s = work.s, .len = kata.len });
+	bytes += kata.len;
+    } while ((elapsed = now_ns() - start) < MIN_LOOP_NS);
+
+    print_result_start("kata2hira");
+    printf(",\"bytes\":%td,\"mb_per_s\":%.2f}\n", bytes, bytes / 1e6 / (elapsed / 1e9));
+    frees8(&kata);
+    frees8(&work);
+}
+
+static int
+remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    return remove(path);
+}
+
+int
+main(int argc, char** argv)
+{
+    corpus_params params = corpus_defaults();
+    long headwords = params.headwords, sources = params.sources;
+    if ((argc > 1 && !parse_number(argv[1], LONG_MAX, &headwords))
+	|| (argc > 2 && !parse_number(argv[2], MAX_SOURCES, &sources))
+	|| headwords == 0 || sources == 0)
+	fatal("Usage: %s [headwords per source [sources]]", argv[0]);
+    params.headwords = (size)headwords;
+    params.sources = (size)sources;
+
+    char workdir[] = "/tmp/jppron-bench.XXXXXX";
+    if (!mkdtemp(workdir))
+	fatal_perror("Creating benchmark directory");
+    s8 corpusdir = buildpath(fromcstr_(workdir), s8("audio"));
+    s8 dbdir = buildpath(fromcstr_(workdir), s8("db"));
+    if (create_dir((char*)corpusdir.s))
+	fatal_perror("Creating directory");
+
+    size records = write_corpus((char*)corpusdir.s, params);
+    print_result_start("corpus");
+    printf(",\"sources\":%td,\"headwords_per_source\":%td,\"records\":%td}\n",
+	   params.sources, params.headwords, records);
+    fflush(stdout);
+
+    bench_parse((char*)corpusdir.s);
+    bench_build((char*)corpusdir.s, dbdir);
+    bench_lookup(dbdir);
+    bench_deinflect();
+    bench_kata2hira();
+
+    nftw(workdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    frees8(&corpusdir);
+    frees8(&dbdir);
+    return EXIT_SUCCESS;
+}
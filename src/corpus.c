@@ -0,0 +1,274 @@
+#include <stdbool.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "corpus.h"
+
+/* splitmix64 */
+static u64
+next_random(u64 state[static 1])
+{
+    u64 z = (*state += 0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
+}
+
+static size
+random_below(u64 state[static 1], size n)
+{
+    return (size)(next_random(state) % (u64)n);
+}
+
+/*
+ * Appends the UTF-8 encoding of the BMP code point @cp to @out
+ */
+static void
+put_utf8(u8** out, u32 cp)
+{
+    if (cp < 0x80)
+	*(*out)++ = (u8)cp;
+    else if (cp < 0x800)
+    {
+	*(*out)++ = (u8)(0xC0 | cp >> 6);
+	*(*out)++ = (u8)(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+	*(*out)++ = (u8)(0xE0 | cp >> 12);
+	*(*out)++ = (u8)(0x80 | (cp >> 6 & 0x3F));
+	*(*out)++ = (u8)(0x80 | (cp & 0x3F));
+    }
+}
+
+// Full-size hiragana, each of them a mora on its own
+static const u32 plain_kana[] = {
+    0x3042, 0x3044, 0x3046, 0x3048, 0x304A, 0x304B, 0x304D, 0x304F, 0x3051, 0x3053,
+    0x3055, 0x3057, 0x3059, 0x305B, 0x305D, 0x305F, 0x3061, 0x3064, 0x3066, 0x3068,
+    0x306A, 0x306B, 0x306C, 0x306D, 0x306E, 0x306F, 0x3072, 0x3075, 0x3078, 0x307B,
+    0x307E, 0x307F, 0x3080, 0x3081, 0x3082, 0x3084, 0x3086, 0x3088, 0x3089, 0x308A,
+    0x308B, 0x308C, 0x308D, 0x308F, 0x3093, 0x304C, 0x304E, 0x3050, 0x3052, 0x3054,
+};
+
+/*
+ * Writes a reading of @morae morae to @out, which needs room for 3 bytes a
+ * mora. With @pitch > 0, the downstep is marked with ＼ after that mora,
+ * which needs another 3 bytes. With @katakana, the same kana are written
+ * as katakana.
+ *
+ * Returns: Its length in bytes
+ */
+static size
+random_reading(u64 state[static 1], i32 morae, i32 pitch, bool katakana, u8* out)
+{
+    u8* p = out;
+    for (i32 i = 0; i < morae; i++)
+    {
+	u32 kana = plain_kana[random_below(state, countof(plain_kana))];
+	put_utf8(&p, katakana ? kana + 0x60 : kana);
+	if (i + 1 == pitch)
+	    put_utf8(&p, 0xFF3C);
+    }
+    return p - out;
+}
+
+/*
+ * Writes a headword of up to four kanji, or a kana word, to @out, which
+ * needs room for 12 bytes
+ */
+static size
+random_headword(u64 state[static 1], u8* out)
+{
+    if (random_below(state, 8) == 0)
+	return random_reading(state, 2 + (i32)random_below(state, 3), 0, false, out);
+
+    u8* p = out;
+    size n = 1 + random_below(state, 4);
+    for (size i = 0; i < n; i++)
+	put_utf8(&p, 0x4E00 + (u32)random_below(state, 0x5000));
+    return p - out;
+}
+
+/*
+ * 16-bit mono WAV at 44.1 kHz with 441 silent frames
+ */
+static const u8 placeholder_wav[44] = {
+    'R', 'I', 'F', 'F', (36 + 882) & 0xFF, (36 + 882) >> 8, 0, 0,
+    'W', 'A', 'V', 'E', 'f', 'm', 't', ' ', 16, 0, 0, 0,
+    1, 0, 1, 0, 0x44, 0xAC, 0, 0, 0x88, 0x58, 0x01, 0, 2, 0, 16, 0,
+    'd', 'a', 't', 'a', 882 & 0xFF, 882 >> 8, 0, 0,
+};
+
+static void
+write_media(const char* path)
+{
+    static const u8 silence[882] = { 0 };
+    FILE* f = fopen(path, "wb");
+    if (!f || fwrite(placeholder_wav, 1, sizeof(placeholder_wav), f) != sizeof(placeholder_wav)
+	|| fwrite(silence, 1, sizeof(silence), f) != sizeof(silence) || fclose(f))
+	fatal_perror("Writing media file");
+}
+
+static void
+make_dir(const char* path)
+{
+    if (mkdir(path, S_IRWXU) && errno != EEXIST)
+	fatal_perror("Creating corpus directory");
+}
+
+/*
+ * Open addressing set of the FNV-1a hashes of the headwords of a source,
+ * with room for twice as many as it holds. A hash collision only makes a
+ * headword be drawn again.
+ */
+typedef struct {
+    u64* slots; // 0 if empty
+    size mask;
+} headword_set;
+
+/*
+ * Returns: false if @hw was in @set already
+ */
+static bool
+add_headword(headword_set* set, u8* hw, size len)
+{
+    u64 h = 0xCBF29CE484222325;
+    for (size i = 0; i < len; i++)
+	h = (h ^ hw[i]) * 0x100000001B3;
+    h |= 1;
+
+    for (size i = (size)(h & (u64)set->mask);; i = (i + 1) & set->mask)
+    {
+	if (set->slots[i] == h)
+	    return false;
+	if (!set->slots[i])
+	{
+	    set->slots[i] = h;
+	    return true;
+	}
+    }
+}
+
+static size
+write_source(const char* dir, size id, corpus_params p)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/index.json", dir);
+    FILE* f = fopen(path, "w");
+    if (!f)
+	fatal_perror("Writing corpus");
+    if (p.media)
+    {
+	snprintf(path, sizeof(path), "%s/media", dir);
+	make_dir(path);
+    }
+
+    u64 state = p.seed ^ (u64)(id + 1) * 0xD1B54A32D192ED03;
+    fprintf(f, "{\"meta\":{\"name\":\"Synthetic source %td\",\"year\":2024,\"version\":1,\"media_dir\":\"media\"},\n", id);
+
+    // The files of every headword are numbered in order, so only their
+    // count is needed to write them out
+    u8* nfiles = new(u8, p.headwords);
+    headword_set seen = { .mask = 1 };
+    while (seen.mask < 2 * p.headwords)
+	seen.mask = 2 * seen.mask + 1;
+    seen.slots = new(u64, seen.mask + 1);
+    fputs("\"headwords\":{", f);
+    size file = 0;
+    for (size i = 0; i < p.headwords; i++)
+    {
+	// Shared headwords are drawn from a state that only depends on @i.
+	// Every headword of a source is a key of one object, so repeated ones
+	// are drawn again from the source's own state.
+	u64 shared = p.seed ^ (u64)i * 0x9E3779B97F4A7C15;
+	u8 hw[16];
+	size len = (i32)random_below(&shared, 100) < p.shared_percent
+		   ? random_headword(&shared, hw)
+		   : random_headword(&state, hw);
+	while (!add_headword(&seen, hw, len))
+	    len = random_headword(&state, hw);
+
+	nfiles[i] = 1;
+	while (nfiles[i] < p.max_files && random_below(&state, 4) == 0)
+	    nfiles[i]++;
+
+	fprintf(f, "%s\n\"%.*s\":[", i ? "," : "", (int)len, (char*)hw);
+	for (size k = 0; k < nfiles[i]; k++)
+	    fprintf(f, "%s\"%td_%td.wav\"", k ? "," : "", id, file++);
+	fputc(']', f);
+    }
+
+    fputs("},\n\"files\":{", f);
+    size records = p.headwords;
+    file = 0;
+    for (size i = 0; i < p.headwords; i++)
+    {
+	for (size k = 0; k < nfiles[i]; k++)
+	{
+	    i32 morae = p.min_morae + (i32)random_below(&state, (size)(p.max_morae - p.min_morae + 1));
+	    i32 pitch = (i32)random_below(&state, (size)morae + 1);
+	    bool katakana = (i32)random_below(&state, 100) < p.katakana_percent;
+	    u64 reading_state = state;
+	    u8 reading[3 * CORPUS_MAX_MORAE];
+	    u8 pattern[3 * CORPUS_MAX_MORAE + 3];
+	    size len = random_reading(&state, morae, 0, katakana, reading);
+	    size patlen = random_reading(&reading_state, morae, pitch, katakana, pattern);
+
+	    fprintf(f, "%s\n\"%td_%td.wav\":{\"kana_reading\":\"%.*s\",\"pitch_pattern\":\"%.*s\",\"pitch_number\":\"%d\"}",
+		    file ? "," : "", id, file, (int)len, (char*)reading, (int)patlen, (char*)pattern, pitch);
+	    if (p.media)
+	    {
+		snprintf(path, sizeof(path), "%s/media/%td_%td.wav", dir, id, file);
+		write_media(path);
+	    }
+	    file++;
+	    records++;
+	}
+    }
+    fputs("}}\n", f);
+
+    free(nfiles);
+    free(seen.slots);
+    if (fclose(f))
+	fatal_perror("Writing corpus");
+    return records;
+}
+
+corpus_params
+corpus_defaults(void)
+{
+    return (corpus_params){
+	.sources = 4,
+	.headwords = 20000,
+	.max_files = 3,
+	.min_morae = 1,
+	.max_morae = 6,
+	.shared_percent = 30,
+	.katakana_percent = 20,
+	.media = false,
+	.seed = 1,
+    };
+}
+
+size
+write_corpus(const char* dir, corpus_params p)
+{
+    if (p.max_files < 1 || p.max_files > 0xFF)
+	fatal("The number of files per headword has to be between 1 and 255.");
+    if (p.min_morae < 1 || p.min_morae > p.max_morae || p.max_morae > CORPUS_MAX_MORAE)
+	fatal("The number of morae has to be between 1 and %d.", CORPUS_MAX_MORAE);
+
+    size records = 0;
+    for (size id = 0; id < p.sources; id++)
+    {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/source%03td", dir, id);
+	make_dir(path);
+	records += write_source(path, id, p);
+    }
+    return records;
+}
@@ -0,0 +1,330 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+#include "util.h"
+#include "daemon.h"
+
+#define MAX_REQUEST_SIZE 65536
+#define CLIENT_TIMEOUT_S 5 // Of a single read or write
+
+s8
+daemon_socket_path(void)
+{
+    return buildpath(fromcstr_((char*)g_get_user_runtime_dir()), s8("jppron.sock"));
+}
+
+static bool
+make_address(const char* sockpath, struct sockaddr_un* addr)
+{
+    *addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+    if (strlen(sockpath) >= sizeof(addr->sun_path))
+    {
+	error_msg("Socket path too long: %s", sockpath);
+	return false;
+    }
+    strcpy(addr->sun_path, sockpath);
+    return true;
+}
+
+static int
+connect_to(const char* sockpath)
+{
+    struct sockaddr_un addr;
+    if (!make_address(sockpath, &addr))
+	return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+	return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static bool
+write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+	ssize_t n = write(fd, data, len);
+	if (n == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	data += n;
+	len -= (size_t)n;
+    }
+    return true;
+}
+
+/*
+ * Like read(), but stores a file descriptor passed with the data in @passed
+ * unless it holds one already. Others are closed.
+ */
+static ssize_t
+read_fd(int fd, char* buf, size_t len, int* passed)
+{
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+	.msg_iov = &iov,
+	.msg_iovlen = 1,
+	.msg_control = control.buf,
+	.msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); n != -1 && c; c = CMSG_NXTHDR(&msg, c))
+    {
+	if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS
+	    || c->cmsg_len != CMSG_LEN(sizeof(int)))
+	    continue;
+	int received;
+	memcpy(&received, CMSG_DATA(c), sizeof(received));
+	if (*passed == -1)
+	    *passed = received;
+	else
+	    close(received);
+    }
+    return n;
+}
+
+/*
+ * Like write(), but passes the file descriptor @passed along with the data
+ */
+static ssize_t
+write_fd(int fd, const char* buf, size_t len, int passed)
+{
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } control = { 0 };
+    struct iovec iov = { .iov_base = (char*)buf, .iov_len = len };
+    struct msghdr msg = {
+	.msg_iov = &iov,
+	.msg_iovlen = 1,
+	.msg_control = control.buf,
+	.msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &passed, sizeof(passed));
+
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, 0)) == -1 && errno == EINTR)
+	;
+    return n;
+}
+
+/*
+ * Reads the request from @fd and splits it into arguments, which point
+ * into @buf. The stderr of the client is stored in @errfd, which is -1 if
+ * it did not pass one.
+ *
+ * Returns: The number of arguments or -1 on a malformed request
+ */
+static int
+read_request(int fd, char buf[MAX_REQUEST_SIZE], char*** argv, int* errfd)
+{
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read_fd(fd, buf + len, MAX_REQUEST_SIZE - len, errfd)) != 0)
+    {
+	if (n == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	len += (size_t)n;
+	if (len == MAX_REQUEST_SIZE)
+	    return -1;
+    }
+    if (len == 0 || buf[len - 1] != '\0')
+	return -1;
+
+    int argc = 0;
+    for (size_t i = 0; i < len; i += strlen(buf + i) + 1)
+    {
+	buf_push(*argv, buf + i);
+	argc++;
+    }
+    return argc;
+}
+
+/*
+ * Runs @handler with stdout redirected to the client socket @fd and stderr
+ * to the stderr of the client, so that errors stay out of its output. If
+ * the client did not pass its stderr, both go to @fd.
+ */
+static void
+handle_client(int fd, daemon_handler handler, void* user_data)
+{
+    static char buf[MAX_REQUEST_SIZE];
+    char** argv = 0;
+    int errfd = -1;
+    int argc = read_request(fd, buf, &argv, &errfd);
+    if (argc <= 0)
+    {
+	error_msg("Received malformed or incomplete request.");
+	goto cleanup;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stderr = dup(STDERR_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(errfd != -1 ? errfd : fd, STDERR_FILENO);
+
+    int status = handler(argc, argv, user_data);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+
+    char trailer[2] = { '\0', (char)status };
+    write_all(fd, trailer, sizeof(trailer));
+
+cleanup:
+    if (errfd != -1)
+	close(errfd);
+    buf_free(argv);
+}
+
+void
+daemon_serve(const char* sockpath, daemon_handler handler, void* user_data)
+{
+    struct sockaddr_un addr;
+    if (!make_address(sockpath, &addr))
+	return;
+
+    int fd = connect_to(sockpath);
+    if (fd != -1)
+    {
+	close(fd);
+	error_msg("A daemon is already listening on %s", sockpath);
+	return;
+    }
+    unlink(sockpath); // Left behind by a daemon that did not exit cleanly
+
+    // A client hanging up must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+	perror("Creating socket");
+	return;
+    }
+    mode_t old_mask = umask(077);
+    int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound == -1 || listen(fd, 16) == -1)
+    {
+	perror("Binding socket");
+	close(fd);
+	return;
+    }
+
+    debug_msg("Listening on %s", sockpath);
+    for (;;)
+    {
+	int client = accept(fd, NULL, NULL);
+	if (client == -1)
+	{
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    perror("Accepting connection");
+	    break;
+	}
+	// Requests are served one at a time, so a client that stops sending
+	// or reading must not hold up the others
+	struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT_S };
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	handle_client(client, handler, user_data);
+	close(client);
+    }
+
+    close(fd);
+    unlink(sockpath);
+}
+
+bool
+daemon_forward(const char* sockpath, int argc, char** argv, int* status)
+{
+    int fd = connect_to(sockpath);
+    if (fd == -1)
+	return false;
+
+    *status = EXIT_FAILURE;
+    // The first byte carries our stderr, see handle_client()
+    bool sent = argc > 0 && write_fd(fd, argv[0], 1, STDERR_FILENO) == 1
+		&& write_all(fd, argv[0] + 1, strlen(argv[0]));
+    for (int i = 1; sent && i < argc; i++)
+	sent = write_all(fd, argv[i], strlen(argv[i]) + 1);
+    if (!sent)
+    {
+	perror("Sending request");
+	close(fd);
+	return true;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // The last two bytes received are held back, since they are the trailer
+    char buf[4096 + 2];
+    size_t kept = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + kept, sizeof(buf) - kept)) != 0)
+    {
+	if (n == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+	    perror("Receiving reply");
+	    break;
+	}
+	kept += (size_t)n;
+	if (kept > 2)
+	{
+	    write_all(STDOUT_FILENO, buf, kept - 2);
+	    memmove(buf, buf + kept - 2, 2);
+	    kept = 2;
+	}
+    }
+
+    if (n == 0 && kept == 2 && buf[0] == '\0')
+	*status = (unsigned char)buf[1];
+    else
+    {
+	write_all(STDOUT_FILENO, buf, kept);
+	if (n == 0)
+	    error_msg("The daemon exited before finishing the request.");
+    }
+    close(fd);
+    return true;
+}
@@ -4,9 +4,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/stat.h>
 
 #include "lmdb.h"
 #include "util.h"
+#include "database.h"
+#include "stats.h"
 
 int rc;
 #define MDB_CHECK(call)                                  \
@@ -20,26 +23,129 @@ int rc;
 MDB_env *env = 0;
 MDB_dbi dbi1 = 0;
 MDB_dbi dbi2 = 0;
+MDB_dbi dbi_sources = 0;
+MDB_dbi dbi_meta = 0;
+MDB_dbi dbi_readings = 0;
+MDB_dbi dbi_pitches = 0;
 MDB_txn *txn = 0;
 bool READONLY = true;
+static dev_t opened_dev = 0; // Identify the data file, see dbreplaced()
+static ino_t opened_ino = 0;
+static char* opened_path = 0;
 
 s8 last_added_key = { 0 };
+s8 last_added_reading = { 0 };
+s8 last_added_pitch = { 0 };
+
+// Names of the dbs derived from dbi1 and dbi2, in the order of their handles
+static const char* const secondary_names[] = { "readings", "pitches" };
+
+static source sources[256] = { 0 }; // Cached for lookups
+static u8 source_rank[256] = { 0 };  // Position of the source's directory in sorted order
+
+enum {
+    SOURCEMETA_VERSION = 1,
+    SOURCEMETA_LEN = 32,
+};
+
+static int
+cmpsourcedir(const void* a, const void* b)
+{
+    return dbcmp(sources[*(const u8*)a].dir, sources[*(const u8*)b].dir);
+}
+
+static void
+loadsources(void)
+{
+    MDB_cursor *cursor = 0;
+    MDB_val key_m = { 0 };
+    MDB_val val_m = { 0 };
+
+    MDB_CHECK(mdb_cursor_open(txn, dbi_sources, &cursor));
+    while ((rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_NEXT)) == 0)
+    {
+	if (key_m.mv_size != 1)
+	    continue;
+	u8 id = *(u8*)key_m.mv_data;
+	frees8(&sources[id].name);
+	sources[id].name = s8dup((s8){ .s = val_m.mv_data, .len = (size)val_m.mv_size });
+
+	// Fields are separated by NUL, see addsource()
+	s8 d = sources[id].name;
+	s8* fields[] = { &sources[id].name, &sources[id].dir, &sources[id].mediadir };
+	for (int i = 0; i < countof(fields); i++)
+	{
+	    u8* sep = memchr(d.s, '\0', (size_t)d.len);
+	    *fields[i] = (s8){ .s = d.s, .len = sep ? sep - d.s : d.len };
+	    d.s += fields[i]->len + (sep ? 1 : 0);
+	    d.len -= fields[i]->len + (sep ? 1 : 0);
+	}
+    }
+    if (rc != MDB_NOTFOUND)
+	MDB_CHECK(rc);
+    mdb_cursor_close(cursor);
+
+    u8 ids[256];
+    int n = 0;
+    for (int id = 0; id < countof(sources); id++)
+    {
+	if (sources[id].name.s)
+	    ids[n++] = (u8)id;
+    }
+    qsort(ids, (size_t)n, sizeof(*ids), cmpsourcedir);
+    for (int i = 0; i < n; i++)
+	source_rank[ids[i]] = (u8)i;
+}
 
 void
-opendb(const char* path, bool readonly)
+opendb(const char* path, dbmode mode)
 {
+    STATS_START(start);
     MDB_CHECK(mdb_env_create(&env));
-    MDB_CHECK(mdb_env_set_maxdbs(env, 2));
+    MDB_CHECK(mdb_env_set_maxdbs(env, 6));
 
-    if (readonly)
+    if (mode == DB_READONLY)
     {
 	READONLY = true;
 	MDB_CHECK(mdb_env_open(env, path, MDB_RDONLY | MDB_NOLOCK | MDB_NORDAHEAD, 0664));
+
+	int fd;
+	struct stat st;
+	MDB_CHECK(mdb_env_get_fd(env, &fd));
+	if (fstat(fd, &st) == 0)
+	{
+	    opened_dev = st.st_dev;
+	    opened_ino = st.st_ino;
+	}
+	opened_path = strdup(path);
+
+	// Committing makes the handles usable by every later transaction
+	MDB_CHECK(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	MDB_CHECK(mdb_dbi_open(txn, "dbi1", MDB_DUPSORT, &dbi1));
+	MDB_CHECK(mdb_dbi_open(txn, "dbi2", 0, &dbi2));
+	if ((rc = mdb_dbi_open(txn, "sources", 0, &dbi_sources)) == MDB_NOTFOUND)
+	    fatal("The database has an outdated format. Please recreate it with 'jppron -c'.");
+	MDB_CHECK(rc);
+	MDB_dbi* secondary[] = { &dbi_readings, &dbi_pitches };
+	for (int i = 0; i < countof(secondary); i++)
+	{
+	    if ((rc = mdb_dbi_open(txn, secondary_names[i], MDB_DUPSORT, secondary[i])) == MDB_NOTFOUND)
+		fatal("The database has an outdated format. Please recreate it with 'jppron -c'.");
+	    MDB_CHECK(rc);
+	}
+	loadsources();
+	MDB_CHECK(mdb_txn_commit(txn));
+
+	// Kept in reset state between lookups, see beginlookup()
+	MDB_CHECK(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	mdb_txn_reset(txn);
     }
     else
     {
 	READONLY = false;
-	unsigned int mapsize = 2147483648; // 1 Gb max
+	// Only reserves address space. Writes go to a temporary copy, which
+	// is compacted before replacing the database, see compactdb().
+	size_t mapsize = SIZE_MAX > UINT32_MAX ? (size_t)16 << 30 : (size_t)1 << 30;
 	MDB_CHECK(mdb_env_set_mapsize(env, mapsize));
 
 	/* MDB_CHECK(mdb_env_open(env, path, MDB_WRITEMAP, 0664)); */
@@ -47,24 +153,115 @@ opendb(const char* path, bool readonly)
 	MDB_CHECK(mdb_txn_begin(env, NULL, 0, &txn));
 	MDB_CHECK(mdb_dbi_open(txn, "dbi1", MDB_DUPSORT | MDB_CREATE, &dbi1));
 	MDB_CHECK(mdb_dbi_open(txn, "dbi2", MDB_CREATE, &dbi2));
+	MDB_CHECK(mdb_dbi_open(txn, "sources", MDB_CREATE, &dbi_sources));
+	MDB_CHECK(mdb_dbi_open(txn, "meta", MDB_CREATE, &dbi_meta));
+
+	// Without one of the secondary indexes the sources have to be indexed
+	// again, which jppron_refresh() does if there is no metadata
+	MDB_dbi* secondary[] = { &dbi_readings, &dbi_pitches };
+	for (int i = 0; i < countof(secondary); i++)
+	{
+	    if ((rc = mdb_dbi_open(txn, secondary_names[i], MDB_DUPSORT, secondary[i])) == MDB_NOTFOUND)
+	    {
+		MDB_CHECK(mdb_dbi_open(txn, secondary_names[i], MDB_DUPSORT | MDB_CREATE, secondary[i]));
+		MDB_CHECK(mdb_drop(txn, dbi_meta, 0));
+	    }
+	    else
+		MDB_CHECK(rc);
+	}
+
+	if (mode == DB_CREATE)
+	{
+	    // Bulk loading appends in key order, so start from empty dbs
+	    MDB_CHECK(mdb_drop(txn, dbi1, 0));
+	    MDB_CHECK(mdb_drop(txn, dbi2, 0));
+	    MDB_CHECK(mdb_drop(txn, dbi_sources, 0));
+	    MDB_CHECK(mdb_drop(txn, dbi_meta, 0));
+	    MDB_CHECK(mdb_drop(txn, dbi_readings, 0));
+	    MDB_CHECK(mdb_drop(txn, dbi_pitches, 0));
+	}
     }
+    STATS_STOP(STAT_DB_OPEN, start);
 }
 
 void
 closedb()
 {
     if (!READONLY)
-    {
 	MDB_CHECK(mdb_txn_commit(txn));
-	mdb_dbi_close(env, dbi1);
-	mdb_dbi_close(env, dbi2);
-    }
+    else
+	mdb_txn_abort(txn);
+    mdb_dbi_close(env, dbi1);
+    mdb_dbi_close(env, dbi2);
+    mdb_dbi_close(env, dbi_sources);
+    if (dbi_meta)
+	mdb_dbi_close(env, dbi_meta);
+    mdb_dbi_close(env, dbi_readings);
+    mdb_dbi_close(env, dbi_pitches);
     mdb_env_close(env);
 
+    for (int i = 0; i < countof(sources); i++)
+    {
+	frees8(&sources[i].name); // Owns the memory of all fields
+	sources[i] = (source){ 0 };
+	source_rank[i] = 0;
+    }
+
     env = 0;
     dbi1 = 0;
     dbi2 = 0;
+    dbi_sources = 0;
+    dbi_meta = 0;
+    dbi_readings = 0;
+    dbi_pitches = 0;
     txn = 0;
+    frees8(&last_added_key);
+    frees8(&last_added_reading);
+    frees8(&last_added_pitch);
+    free(opened_path);
+    opened_path = 0;
+    opened_dev = 0;
+    opened_ino = 0;
+}
+
+void
+copydb(const char* path, const char* dstdir)
+{
+    MDB_env *src = 0;
+    MDB_CHECK(mdb_env_create(&src));
+    MDB_CHECK(mdb_env_set_maxdbs(src, 4));
+    MDB_CHECK(mdb_env_open(src, path, MDB_RDONLY | MDB_NOLOCK, 0664));
+    MDB_CHECK(mdb_env_copy2(src, dstdir, 0));
+    mdb_env_close(src);
+}
+
+void
+compactdb(const char* dstdir)
+{
+    // The copy only sees committed data
+    MDB_CHECK(mdb_txn_commit(txn));
+    MDB_CHECK(mdb_env_copy2(env, dstdir, MDB_CP_COMPACT));
+    MDB_CHECK(mdb_txn_begin(env, NULL, 0, &txn));
+}
+
+bool
+dbreplaced(void)
+{
+    if (!opened_path)
+	return false;
+
+    size_t len = strlen(opened_path);
+    char* datafile = malloc(len + sizeof("/data.mdb"));
+    if (!datafile)
+	return false;
+    memcpy(datafile, opened_path, len);
+    memcpy(datafile + len, "/data.mdb", sizeof("/data.mdb"));
+
+    struct stat st;
+    bool replaced = stat(datafile, &st) == 0
+		    && (st.st_dev != opened_dev || st.st_ino != opened_ino);
+    free(datafile);
+    return replaced;
 }
 
 void
@@ -96,6 +293,105 @@ addtodb1(s8 key, s8 val)
     }
 }
 
+/*
+ * Same as addtodb1, but only appends to the end of the database, which
+ * avoids page splits and leaves densely packed pages.
+ * Expects keys in ascending dbcmp order and the values of a key in ascending order.
+ */
+/*
+ * Appends to the DUPSORT db @dbi, where @last is the key appended before
+ */
+static void
+append_dupsort(MDB_dbi dbi, s8* last, s8 key, s8 val)
+{
+    MDB_val mdb_key = { .mv_data = key.s, .mv_size = (size_t)key.len };
+    MDB_val mdb_val = { .mv_data = val.s, .mv_size = (size_t)val.len };
+
+    if (s8equals(*last, key))
+	MDB_CHECK(mdb_put(txn, dbi, &mdb_key, &mdb_val, MDB_APPENDDUP));
+    else
+    {
+	MDB_CHECK(mdb_put(txn, dbi, &mdb_key, &mdb_val, MDB_APPEND));
+	frees8(last);
+	*last = s8dup(key);
+    }
+}
+
+void
+appendtodb1(s8 key, s8 val)
+{
+    append_dupsort(dbi1, &last_added_key, key, val);
+}
+
+static void
+insert_dupsort(MDB_dbi dbi, s8 key, s8 val)
+{
+    MDB_val mdb_key = { .mv_data = key.s, .mv_size = (size_t)key.len };
+    MDB_val mdb_val = { .mv_data = val.s, .mv_size = (size_t)val.len };
+
+    rc = mdb_put(txn, dbi, &mdb_key, &mdb_val, MDB_NODUPDATA);
+    if (rc != MDB_KEYEXIST)
+	MDB_CHECK(rc);
+}
+
+void
+inserttodb1(s8 key, s8 val)
+{
+    insert_dupsort(dbi1, key, val);
+}
+
+/*
+ * reading + fileref db
+ */
+s8
+readingkey(s8 reading, s8 headword)
+{
+    s8 key = news8(reading.len + 1 + headword.len);
+    u8copy(key.s, reading.s, reading.len);
+    key.s[reading.len] = '\0';
+    u8copy(key.s + reading.len + 1, headword.s, headword.len);
+    return key;
+}
+
+void
+appendreading(s8 key, s8 fileref)
+{
+    append_dupsort(dbi_readings, &last_added_reading, key, fileref);
+}
+
+void
+insertreading(s8 key, s8 fileref)
+{
+    insert_dupsort(dbi_readings, key, fileref);
+}
+
+/*
+ * pitch + fileref db
+ */
+s8
+pitchkey(u8 pitch, u8 morae, s8 reading, s8 headword)
+{
+    s8 key = news8(2 + reading.len + 1 + headword.len);
+    key.s[0] = pitch;
+    key.s[1] = morae;
+    s8 rk = readingkey(reading, headword);
+    u8copy(key.s + 2, rk.s, rk.len);
+    frees8(&rk);
+    return key;
+}
+
+void
+appendpitch(s8 key, s8 fileref)
+{
+    append_dupsort(dbi_pitches, &last_added_pitch, key, fileref);
+}
+
+void
+insertpitch(s8 key, s8 fileref)
+{
+    insert_dupsort(dbi_pitches, key, fileref);
+}
+
 /*
  * file -> fileinfo db
  */
@@ -112,33 +408,300 @@ addtodb2(s8 key, s8 val)
 	MDB_CHECK(rc);
 }
 
+/*
+ * Same as addtodb2, but expects keys in ascending dbcmp order
+ */
+void
+appendtodb2(s8 key, s8 val)
+{
+    MDB_val mdb_key = { .mv_data = key.s, .mv_size = (size_t)key.len };
+    MDB_val mdb_val = { .mv_data = val.s, .mv_size = (size_t)val.len };
+
+    MDB_CHECK(mdb_put(txn, dbi2, &mdb_key, &mdb_val, MDB_APPEND));
+}
+
+void
+addsource(u8 id, source src)
+{
+    s8 sep = s8("\0");
+    s8 data = s8concat(src.name, sep, src.dir, sep, src.mediadir);
+    MDB_val mdb_key = { .mv_data = &id, .mv_size = 1 };
+    MDB_val mdb_val = { .mv_data = data.s, .mv_size = (size_t)data.len };
+
+    MDB_CHECK(mdb_put(txn, dbi_sources, &mdb_key, &mdb_val, 0));
+    frees8(&data);
+}
+
+source
+getsource(u8 id)
+{
+    return sources[id];
+}
+
+/*
+ * Deletes the file references of the sources in @ids from the DUPSORT db @dbi
+ */
+static void
+delete_refs(MDB_dbi dbi, const bool ids[static 256])
+{
+    MDB_cursor *cursor = 0;
+    MDB_val key_m = { 0 };
+    MDB_val val_m = { 0 };
+
+    // File references start with the source id, but the db is not keyed by
+    // them, so all of it has to be searched
+    MDB_CHECK(mdb_cursor_open(txn, dbi, &cursor));
+    while ((rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_NEXT)) == 0)
+    {
+	if (val_m.mv_size > 0 && ids[*(u8*)val_m.mv_data])
+	    MDB_CHECK(mdb_cursor_del(cursor, 0));
+    }
+    if (rc != MDB_NOTFOUND)
+	MDB_CHECK(rc);
+    mdb_cursor_close(cursor);
+}
+
+void
+deletesources(const u8* ids, size n)
+{
+    if (n == 0)
+	return;
+
+    bool doomed[256] = { 0 };
+    for (size i = 0; i < n; i++)
+	doomed[ids[i]] = true;
+
+    delete_refs(dbi1, doomed);
+    delete_refs(dbi_readings, doomed);
+    delete_refs(dbi_pitches, doomed);
+
+    for (size i = 0; i < n; i++)
+    {
+	MDB_cursor *cursor = 0;
+	MDB_val key_m = { .mv_data = (u8*)&ids[i], .mv_size = 1 };
+	MDB_val val_m = { 0 };
+
+	// In dbi2 they are all next to each other
+	MDB_CHECK(mdb_cursor_open(txn, dbi2, &cursor));
+	rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_SET_RANGE);
+	while (rc == 0 && *(u8*)key_m.mv_data == ids[i])
+	{
+	    MDB_CHECK(mdb_cursor_del(cursor, 0));
+	    rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_NEXT);
+	}
+	if (rc != 0 && rc != MDB_NOTFOUND)
+	    MDB_CHECK(rc);
+	mdb_cursor_close(cursor);
+
+	key_m = (MDB_val){ .mv_data = (u8*)&ids[i], .mv_size = 1 };
+	if ((rc = mdb_del(txn, dbi_sources, &key_m, NULL)) != MDB_NOTFOUND)
+	    MDB_CHECK(rc);
+    }
+}
+
+static u64
+get_u64(u8* p)
+{
+    u64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void
+put_u64(u8* p, u64 v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static bool
+decodesourcemeta(MDB_val val_m, sourcemeta* meta)
+{
+    u8* d = val_m.mv_data;
+    if (val_m.mv_size != SOURCEMETA_LEN || d[0] != SOURCEMETA_VERSION)
+	return false;
+    *meta = (sourcemeta){
+	.id = d[1],
+	.mtime = (i64)get_u64(d + 8),
+	.size = (i64)get_u64(d + 16),
+	.hash = get_u64(d + 24),
+    };
+    return true;
+}
+
+bool
+getsourcemeta(s8 dir, sourcemeta* meta)
+{
+    MDB_val key_m = { .mv_data = dir.s, .mv_size = (size_t)dir.len };
+    MDB_val val_m = { 0 };
+
+    if ((rc = mdb_get(txn, dbi_meta, &key_m, &val_m)) == MDB_NOTFOUND)
+	return false;
+    MDB_CHECK(rc);
+    return decodesourcemeta(val_m, meta);
+}
+
+size
+readsourcemetas(const char* path, s8** dirs, sourcemeta** metas)
+{
+    MDB_env *src = 0;
+    MDB_txn *rtxn = 0;
+    MDB_dbi meta = 0;
+    MDB_dbi unused = 0;
+    size ret = -1;
+
+    MDB_CHECK(mdb_env_create(&src));
+    MDB_CHECK(mdb_env_set_maxdbs(src, 6));
+    MDB_CHECK(mdb_env_open(src, path, MDB_RDONLY | MDB_NOLOCK, 0664));
+    MDB_CHECK(mdb_txn_begin(src, NULL, MDB_RDONLY, &rtxn));
+
+    // Opening the database for writing recreates missing secondary indexes
+    // and drops the metadata along with them
+    bool complete = true;
+    for (int i = 0; i < countof(secondary_names) && complete; i++)
+    {
+	if ((rc = mdb_dbi_open(rtxn, secondary_names[i], MDB_DUPSORT, &unused)) == MDB_NOTFOUND)
+	    complete = false;
+	else
+	    MDB_CHECK(rc);
+    }
+    if (complete && (rc = mdb_dbi_open(rtxn, "meta", 0, &meta)) != MDB_NOTFOUND)
+    {
+	MDB_CHECK(rc);
+
+	MDB_cursor *cursor = 0;
+	MDB_val key_m = { 0 };
+	MDB_val val_m = { 0 };
+	MDB_CHECK(mdb_cursor_open(rtxn, meta, &cursor));
+	while ((rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_NEXT)) == 0)
+	{
+	    sourcemeta m;
+	    if (!decodesourcemeta(val_m, &m))
+		continue;
+	    buf_push(*dirs, s8dup((s8){ .s = key_m.mv_data, .len = (size)key_m.mv_size }));
+	    buf_push(*metas, m);
+	}
+	if (rc != MDB_NOTFOUND)
+	    MDB_CHECK(rc);
+	mdb_cursor_close(cursor);
+	ret = (size)buf_size(*dirs);
+    }
+
+    mdb_txn_abort(rtxn);
+    mdb_env_close(src);
+    return ret > 0 ? ret : -1;
+}
+
+void
+putsourcemeta(s8 dir, sourcemeta meta)
+{
+    // Native byte order, since the database is not portable anyway
+    u8 d[SOURCEMETA_LEN] = { SOURCEMETA_VERSION, meta.id };
+    put_u64(d + 8, (u64)meta.mtime);
+    put_u64(d + 16, (u64)meta.size);
+    put_u64(d + 24, meta.hash);
+
+    MDB_val key_m = { .mv_data = dir.s, .mv_size = (size_t)dir.len };
+    MDB_val val_m = { .mv_data = d, .mv_size = sizeof(d) };
+    MDB_CHECK(mdb_put(txn, dbi_meta, &key_m, &val_m, 0));
+}
+
+void
+delsourcemeta(s8 dir)
+{
+    MDB_val key_m = { .mv_data = dir.s, .mv_size = (size_t)dir.len };
+    if ((rc = mdb_del(txn, dbi_meta, &key_m, NULL)) != MDB_NOTFOUND)
+	MDB_CHECK(rc);
+}
+
+s8*
+getmetadirs(void)
+{
+    s8* ret = 0;
+    MDB_cursor *cursor = 0;
+    MDB_val key_m = { 0 };
+    MDB_val val_m = { 0 };
+
+    MDB_CHECK(mdb_cursor_open(txn, dbi_meta, &cursor));
+    while ((rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_NEXT)) == 0)
+	buf_push(ret, s8dup((s8){ .s = key_m.mv_data, .len = (size)key_m.mv_size }));
+    if (rc != MDB_NOTFOUND)
+	MDB_CHECK(rc);
+    mdb_cursor_close(cursor);
+    return ret;
+}
+
+/*
+ * The default LMDB ordering: bytewise, with a prefix sorting first
+ */
+i32
+dbcmp(s8 a, s8 b)
+{
+    size n = a.len < b.len ? a.len : b.len;
+    i32 r = n ? memcmp(a.s, b.s, (size_t)n) : 0;
+    if (r)
+	return r;
+    return (a.len > b.len) - (a.len < b.len);
+}
+
+void
+beginlookup(void)
+{
+    assert(READONLY);
+    STATS_START(start);
+    MDB_CHECK(mdb_txn_renew(txn));
+    STATS_STOP(STAT_TXN_BEGIN, start);
+}
+
+void
+endlookup(void)
+{
+    mdb_txn_reset(txn);
+}
+
 s8
 getfromdb2(s8 key)
 {
-    MDB_CHECK(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
-    MDB_CHECK(mdb_dbi_open(txn, "dbi2", 0, &dbi2)); // TODO: Fix silent error
-
     MDB_val key_m = (MDB_val) { .mv_data = key.s, .mv_size = (size_t)key.len };
     MDB_val val_m = { 0 };
 
     if ((rc = mdb_get(txn, dbi2, &key_m, &val_m)) == MDB_NOTFOUND)
-	return (s8){ 0 }
-    ;
+	return (s8){ 0 };
     MDB_CHECK(rc);
 
-    s8 ret = s8dup((s8){ .s = val_m.mv_data, .len = val_m.mv_size });
+    return (s8){ .s = val_m.mv_data, .len = (size)val_m.mv_size };
+}
 
-    mdb_dbi_close(env, dbi2);
-    mdb_txn_abort(txn);
-    return ret;
+/*
+ * Keeps only the file references of @refs that belong to the source with
+ * the highest priority among them
+ */
+static void
+keep_first_source(s8* refs)
+{
+    // The values are sorted by source id, which is not the order of priority
+    size_t n = buf_size(refs);
+    u8 best = n ? refs[0].s[0] : 0;
+    for (size_t i = 1; i < n; i++)
+    {
+	if (source_rank[refs[i].s[0]] < source_rank[best])
+	    best = refs[i].s[0];
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+	if (refs[i].s[0] == best)
+	    refs[kept++] = refs[i];
+    }
+    if (refs)
+	buf_ptr(refs)->size = kept;
 }
 
 s8*
 getfiles(s8 key)
 {
-    MDB_CHECK(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
-    MDB_CHECK(mdb_dbi_open(txn, "dbi1", MDB_DUPSORT, &dbi1));
-
+    if (key.len == 0)
+	return 0; // Rejected by LMDB, and there are no such keys
+    STATS_START(start);
     s8* ret = 0;
 
     MDB_val key_m = (MDB_val) { .mv_data = key.s, .mv_size = (size_t)key.len };
@@ -150,15 +713,181 @@ getfiles(s8 key)
     bool first = true;
     while ((rc = mdb_cursor_get(cursor, &key_m, &val_m, first ? MDB_SET_KEY : MDB_NEXT_DUP)) == 0)
     {
-	s8 val = s8dup((s8){ .s = val_m.mv_data, .len = val_m.mv_size });
-	buf_push(ret, val);
+	s8 val = (s8){ .s = val_m.mv_data, .len = (size)val_m.mv_size };
+	if (val.len)
+	    buf_push(ret, val);
 
 	first = 0;
     }
     if (rc != MDB_NOTFOUND)
 	MDB_CHECK(rc);
+    mdb_cursor_close(cursor);
 
-    mdb_dbi_close(env, dbi1);
-    mdb_txn_abort(txn);
+    keep_first_source(ret);
+    STATS_STOP(STAT_CURSOR_WALK, start);
     return ret;
 }
+
+s8*
+getfilesbyreading(s8 headword, s8 reading)
+{
+    STATS_START(start);
+    s8* ret = 0;
+
+    s8 key = readingkey(reading, headword);
+    MDB_val key_m = (MDB_val) { .mv_data = key.s, .mv_size = (size_t)key.len };
+    MDB_val val_m = { 0 };
+
+    MDB_cursor *cursor = 0;
+    MDB_CHECK(mdb_cursor_open(txn, dbi_readings, &cursor));
+
+    bool first = true;
+    while ((rc = mdb_cursor_get(cursor, &key_m, &val_m, first ? MDB_SET_KEY : MDB_NEXT_DUP)) == 0)
+    {
+	buf_push(ret, ((s8){ .s = val_m.mv_data, .len = (size)val_m.mv_size }));
+	first = false;
+    }
+    if (rc != MDB_NOTFOUND)
+	MDB_CHECK(rc);
+    mdb_cursor_close(cursor);
+    frees8(&key);
+
+    keep_first_source(ret);
+    STATS_STOP(STAT_CURSOR_WALK, start);
+    return ret;
+}
+
+void
+getpitchentries(u8 pitch, i32 morae, pitch_callback cb, void* user_data)
+{
+    u8 prefix[2] = { pitch, morae >= 0 ? (u8)morae : 0 };
+    size_t prefixlen = morae >= 0 ? 2 : 1;
+    MDB_val key_m = (MDB_val) { .mv_data = prefix, .mv_size = prefixlen };
+    MDB_val val_m = { 0 };
+
+    MDB_cursor *cursor = 0;
+    MDB_CHECK(mdb_cursor_open(txn, dbi_pitches, &cursor));
+
+    rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_SET_RANGE);
+    while (rc == 0 && key_m.mv_size > 2 && memcmp(key_m.mv_data, prefix, prefixlen) == 0)
+    {
+	u8* k = key_m.mv_data;
+	u8* sep = memchr(k + 2, '\0', key_m.mv_size - 2);
+	if (sep)
+	{
+	    pitchentry e = {
+		.headword = { .s = sep + 1, .len = (size)key_m.mv_size - (sep + 1 - k) },
+		.reading = { .s = k + 2, .len = sep - (k + 2) },
+		.pitch = k[0],
+		.morae = k[1],
+		.fileref = { .s = val_m.mv_data, .len = (size)val_m.mv_size },
+	    };
+	    if (!cb(e, user_data))
+		break;
+	}
+	rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_NEXT);
+    }
+    if (rc != 0 && rc != MDB_NOTFOUND)
+	MDB_CHECK(rc);
+    mdb_cursor_close(cursor);
+}
+
+void
+getheadwords(s8 prefix, size offset, size limit, headword_callback cb, void* user_data)
+{
+    MDB_val key_m = (MDB_val) { .mv_data = prefix.s, .mv_size = (size_t)prefix.len };
+    MDB_val val_m = { 0 };
+
+    MDB_cursor *cursor = 0;
+    MDB_CHECK(mdb_cursor_open(txn, dbi1, &cursor));
+
+    // Keys with the prefix are contiguous and start at the first key not
+    // smaller than it. NODUP steps over the files of a headword.
+    size n = 0;
+    rc = mdb_cursor_get(cursor, &key_m, &val_m, prefix.len ? MDB_SET_RANGE : MDB_FIRST);
+    while (rc == 0 && (limit <= 0 || n - offset < limit)
+	   && key_m.mv_size >= (size_t)prefix.len
+	   && memcmp(key_m.mv_data, prefix.s, (size_t)prefix.len) == 0)
+    {
+	s8 headword = { .s = key_m.mv_data, .len = (size)key_m.mv_size };
+	if (n++ >= offset && !cb(headword, user_data))
+	    break;
+	rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_NEXT_NODUP);
+    }
+    if (rc != 0 && rc != MDB_NOTFOUND)
+	MDB_CHECK(rc);
+    mdb_cursor_close(cursor);
+}
+
+readingentry*
+getreadingentries(s8 reading)
+{
+    STATS_START(start);
+    readingentry* ret = 0;
+
+    // All keys of @reading start with it followed by a NUL byte
+    s8 prefix = readingkey(reading, (s8){ 0 });
+    MDB_val key_m = (MDB_val) { .mv_data = prefix.s, .mv_size = (size_t)prefix.len };
+    MDB_val val_m = { 0 };
+
+    MDB_cursor *cursor = 0;
+    MDB_CHECK(mdb_cursor_open(txn, dbi_readings, &cursor));
+
+    rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_SET_RANGE);
+    while (rc == 0 && key_m.mv_size >= (size_t)prefix.len
+	   && memcmp(key_m.mv_data, prefix.s, (size_t)prefix.len) == 0)
+    {
+	readingentry e = {
+	    .headword = { .s = (u8*)key_m.mv_data + prefix.len, .len = (size)key_m.mv_size - prefix.len },
+	    .fileref = { .s = val_m.mv_data, .len = (size)val_m.mv_size },
+	};
+	buf_push(ret, e);
+	rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_NEXT);
+    }
+    if (rc != 0 && rc != MDB_NOTFOUND)
+	MDB_CHECK(rc);
+    mdb_cursor_close(cursor);
+    frees8(&prefix);
+    STATS_STOP(STAT_CURSOR_WALK, start);
+    return ret;
+}
+
+void
+haskeys(s8* keys, size n, bool* found)
+{
+    STATS_START(start);
+    MDB_cursor *cursor = 0;
+    MDB_CHECK(mdb_cursor_open(txn, dbi1, &cursor));
+
+    // The cursor rests on the first key not smaller than the last probed
+    // one, which answers every following key up to it without a seek
+    s8 current = { 0 };
+    bool positioned = false;
+    size i = 0;
+    for (; i < n; i++)
+    {
+	if (keys[i].len == 0)
+	{
+	    // LMDB rejects empty keys, and there are none in the db
+	    found[i] = false;
+	    continue;
+	}
+	if (!positioned || dbcmp(current, keys[i]) < 0)
+	{
+	    MDB_val key_m = { .mv_data = keys[i].s, .mv_size = (size_t)keys[i].len };
+	    MDB_val val_m = { 0 };
+	    if ((rc = mdb_cursor_get(cursor, &key_m, &val_m, MDB_SET_RANGE)) == MDB_NOTFOUND)
+		break; // All remaining keys are larger than the last one in the db
+	    MDB_CHECK(rc);
+
+	    current = (s8){ .s = key_m.mv_data, .len = (size)key_m.mv_size };
+	    positioned = true;
+	}
+	found[i] = dbcmp(current, keys[i]) == 0;
+    }
+    for (; i < n; i++)
+	found[i] = false;
+
+    mdb_cursor_close(cursor);
+    STATS_STOP(STAT_CURSOR_WALK, start);
+}
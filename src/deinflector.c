@@ -8,360 +8,786 @@
 #include <mecab.h>
 
 #include "util.h"
+#include "deinflector.h"
+#include "stats.h"
 
-s8* deinfs;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define startswith(str, prefix)                                                           \
-	(str.len >= lengthof(prefix) && !u8compare(str.s, (u8*)prefix, lengthof(prefix)))
-
-#define endswith(str, suffix)                                                                                     \
-	(str.len >= lengthof(suffix) && !u8compare(str.s + str.len - lengthof(suffix), (u8*)suffix, lengthof(suffix)))
+/*
+ * Convertible katakana range from ァ (E3 82 A1) to ヶ (E3 83 B6), plus ヽ and ヾ.
+ * Expects 3 readable bytes at @h.
+ */
+static inline bool
+is_convertible_katakana(const u8* h)
+{
+	return h[0] == 0xe3 &&
+	       ((h[1] == 0x82 && h[2] >= 0xa1 && h[2] <= 0xbf) ||
+		(h[1] == 0x83 && h[2] >= 0x80 && (h[2] <= 0xb6 || h[2] == 0xbd || h[2] == 0xbe)));
+}
 
-#define IF_STARTSWITH_REPLACE(prefix, replacement)                                 \
-	if (startswith(word, prefix))                                              \
-	{                                                                          \
-		add_replace_prefix(word, s8(replacement), lengthof(replacement));  \
+static inline void
+convert_katakana(u8* h)
+{
+	if (h[2] >= 0xa0)
+	{
+		h[1] -= 1;
+		h[2] -= 0x20;
 	}
-
-// TODO: Would be cool if the for loop could expand at compile time, so s8(..) can be used
-// 	 Or just use multiple with different arguement length
-#define IF_ENDSWITH_REPLACE(ending, ...)                                                      \
-	if (endswith(word, ending))                                                           \
-	{                                                                                     \
-		for (char **iterator = (char*[]){ __VA_ARGS__, NULL }; *iterator; iterator++) \
-		{                                                                             \
-			add_replace_suffix(word, fromcstr_(*iterator), lengthof(ending));    \
-		}                                                                             \
+	else
+	{
+		h[1] -= 2;
+		h[2] += 0x20;
 	}
+}
 
-#define IF_ENDSWITH_CONVERT_ATOU(ending)           \
-	if (endswith(word, ending))                \
-	{                                          \
-		atou_form(word, lengthof(ending)); \
-	}
+#ifdef __SSE2__
+/*
+ * Returns: A mask of the bytes of @v that start a convertible katakana. Only
+ *          the first 14 bytes are considered, since the last two have no
+ *          complete character in @v.
+ */
+static inline __m128i
+katakana_mask(__m128i v)
+{
+	const __m128i first14 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0);
+	__m128i mid = _mm_srli_si128(v, 1);
+	__m128i trail = _mm_srli_si128(v, 2);
+
+	// Continuation bytes 80..BF become 00..3F, everything else is out of that range
+	__m128i t = _mm_xor_si128(trail, _mm_set1_epi8((char)0x80));
+	__m128i cont = _mm_and_si128(_mm_cmpgt_epi8(t, _mm_set1_epi8(-1)),
+				     _mm_cmplt_epi8(t, _mm_set1_epi8(0x40)));
+
+	__m128i row82 = _mm_and_si128(_mm_cmpeq_epi8(mid, _mm_set1_epi8((char)0x82)),
+				      _mm_cmpgt_epi8(t, _mm_set1_epi8(0x20)));
+	__m128i row83 = _mm_and_si128(_mm_cmpeq_epi8(mid, _mm_set1_epi8((char)0x83)),
+				      _mm_or_si128(_mm_cmplt_epi8(t, _mm_set1_epi8(0x37)),
+						   _mm_or_si128(_mm_cmpeq_epi8(trail, _mm_set1_epi8((char)0xbd)),
+								_mm_cmpeq_epi8(trail, _mm_set1_epi8((char)0xbe)))));
+
+	__m128i lead = _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xe3));
+	return _mm_and_si128(_mm_and_si128(lead, first14),
+			     _mm_and_si128(cont, _mm_or_si128(row82, row83)));
+}
 
-#define IF_ENDSWITH_CONVERT_ITOU(ending)           \
-	if (endswith(word, ending))                \
-	{                                          \
-		itou_form(word, lengthof(ending)); \
-	}
+/*
+ * Applies convert_katakana() to every character of @v marked in @mask.
+ */
+static inline __m128i
+convert_katakana_simd(__m128i v, __m128i mask)
+{
+	__m128i trail = _mm_srli_si128(v, 2);
+	__m128i t = _mm_xor_si128(trail, _mm_set1_epi8((char)0x80));
+	__m128i high = _mm_cmpgt_epi8(t, _mm_set1_epi8(0x1f)); // Trail byte >= A0
 
-#define IF_EQUALS_ADD(str, wordtoadd)             \
-	if (s8equals(word, s8(str)))              \
-	{                                         \
-		buf_push(deinfs, s8dup(s8(str))); \
+	// -1 or -2 for the middle byte, -0x20 or +0x20 for the trail byte
+	__m128i mid_delta = _mm_sub_epi8(_mm_set1_epi8((char)0xfe), high);
+	__m128i trail_delta = _mm_add_epi8(_mm_set1_epi8(0x20), _mm_and_si128(high, _mm_set1_epi8((char)0xc0)));
+
+	v = _mm_add_epi8(v, _mm_slli_si128(_mm_and_si128(mid_delta, mask), 1));
+	return _mm_add_epi8(v, _mm_slli_si128(_mm_and_si128(trail_delta, mask), 2));
+}
+#endif
+
+void
+kata2hira_inplace(s8 s)
+{
+	size i = 0;
+#ifdef __SSE2__
+	// Windows overlap by two bytes, so that every character is complete in one
+	for (; i + 16 <= s.len; i += 14)
+	{
+		__m128i v = _mm_loadu_si128((__m128i*)(s.s + i));
+		__m128i mask = katakana_mask(v);
+		if (_mm_movemask_epi8(mask))
+			_mm_storeu_si128((__m128i*)(s.s + i), convert_katakana_simd(v, mask));
 	}
+#endif
+	// 0xE3 is never a continuation byte, so no need to find character boundaries
+	for (; i + 2 < s.len; i++)
+	{
+		if (is_convertible_katakana(s.s + i))
+		{
+			convert_katakana(s.s + i);
+			i += 2;
+		}
+	}
+}
 
-static const u8 utf8_skip_data[256] = {
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-  2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
-  3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,4,4,4,4,4,4,4,4,5,5,5,5,6,6,1,1
-};
-#define skip_utf8_char(p) (u8*)((p) + utf8_skip_data[*(const u8 *)(p)])
+bool
+has_katakana(s8 s)
+{
+	size i = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= s.len; i += 14)
+	{
+		if (_mm_movemask_epi8(katakana_mask(_mm_loadu_si128((__m128i*)(s.s + i)))))
+			return true;
+	}
+#endif
+	for (; i + 2 < s.len; i++)
+	{
+		if (is_convertible_katakana(s.s + i))
+			return true;
+	}
+	return false;
+}
 
 s8
 kata2hira(s8 kata_in)
 {
 	s8 hira_out = s8dup(kata_in);
-	u8* h = hira_out.s;
+	kata2hira_inplace(hira_out);
+	return hira_out;
+}
 
-	for (; *h; h = skip_utf8_char(h))
+i32
+count_morae(s8 kana)
+{
+	i32 morae = 0;
+	for (size i = 0; i + 2 < kana.len; i++)
 	{
-		/* Check that this is within the katakana block from E3 82 A0 to E3 83 BF. */
-		if (h[0] == 0xe3 && (h[1] == 0x82 || h[1] == 0x83) && h[2] != '\0')
+		// Kana are U+3041 - U+30FF, i.e. E3 81 81 - E3 83 BF in UTF-8
+		const u8* c = kana.s + i;
+		if (c[0] != 0xE3 || c[1] < 0x81 || c[1] > 0x83)
+			continue;
+		u32 cp = 0x3000 | (u32)(c[1] & 0x3F) << 6 | (c[2] & 0x3F);
+		i += 2;
+
+		if (cp >= 0x30A1 && cp <= 0x30F6)
+			cp -= 0x60; // Katakana
+		switch (cp)
 		{
-			/* Check that this is within the range of katakana which
-			   can be converted into hiragana. */
-			if ((h[1] == 0x82 && h[2] >= 0xa1) ||
-			    (h[1] == 0x83 && h[2] <= 0xb6) ||
-			    (h[1] == 0x83 && (h[2] == 0xbd || h[2] == 0xbe)))
-			{
-				/* Byte conversion from katakana to hiragana. */
-				if (h[2] >= 0xa0)
-				{
-					h[1] -= 1;
-					h[2] -= 0x20;
-				}
-				else
-				{
-					h[1] = h[1] - 2;
-					h[2] += 0x20;
-				}
-			}
+		// Small kana, which form a mora with the one before
+		case 0x3041: case 0x3043: case 0x3045: case 0x3047: case 0x3049:
+		case 0x3083: case 0x3085: case 0x3087: case 0x308E:
+		case 0x30FB: // Middle dot
+			break;
+		default:
+			if ((cp >= 0x3041 && cp <= 0x3096) || cp == 0x30FC) // With the long vowel mark
+				morae++;
 		}
 	}
-	return hira_out;
+	return morae;
 }
 
-/**
- * add_replace_suffix:
- * @word: The word whose ending should be replaced
- * @replacement: The UTF-8 encoded string the ending should be replaced with
- * @suffix_len: The length of the suffix (in bytes) that should be replaced
- *
- * Replaces the last @suffix_len bytes of @word with @replacement.
- */
-static void
-add_replace_suffix(s8 word, s8 replacement, size suffix_len)
-{
-	assert(word.s);
-	assert(word.len >= suffix_len);
-	assert(replacement.len >= 0);
-
-	s8 replstr = {0};
-	replstr.len = word.len - suffix_len + replacement.len;
-	replstr.s = new(u8, replstr.len);
+/* ------------------- Start kanji2hira ------------------- */
+enum {
+	READING_CACHE_SIZE = 4096,
+	IPADIC_READING_FIELD = 7, // Index of the reading in the MeCab feature string
+};
 
-	memcpy(replstr.s, word.s, (size_t)(word.len - suffix_len));
-	if (replacement.len)
-		memcpy(replstr.s + word.len - suffix_len, replacement.s, (size_t)replacement.len);
+/* An entry of the LRU cache of readings */
+typedef struct cache_entry {
+	s8 word; // Key in the hash table, null-terminated
+	s8 reading;
+	struct cache_entry* prev; // More recently used, NULL for the most recent
+	struct cache_entry* next; // Less recently used, NULL for the least recent
+} cache_entry;
+
+/* All of it is guarded by @lock */
+static struct {
+	GMutex lock;
+	mecab_t* tagger;
+	bool unavailable;
+	GHashTable* cache;
+	cache_entry* most_recent;
+	cache_entry* least_recent;
+} mecab;
 
-	buf_push(deinfs, replstr);
+static void
+cache_unlink(cache_entry* e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		mecab.most_recent = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		mecab.least_recent = e->prev;
+	e->prev = e->next = NULL;
 }
 
 static void
-add_replace_prefix(s8 word, s8 replacement, size prefix_len)
+cache_push_front(cache_entry* e)
 {
-	assert(word.s);
-	assert(word.len >= prefix_len);
-	assert(replacement.len >= 0);
+	e->next = mecab.most_recent;
+	if (mecab.most_recent)
+		mecab.most_recent->prev = e;
+	mecab.most_recent = e;
+	if (!mecab.least_recent)
+		mecab.least_recent = e;
+}
 
-	s8 replstr = {0};
-	replstr.len = word.len - prefix_len + replacement.len;
-	replstr.s = new(u8, replstr.len);
+static void
+cache_entry_free(gpointer data)
+{
+	cache_entry* e = data;
+	frees8(&e->word);
+	frees8(&e->reading);
+	free(e);
+}
 
-	if (replacement.len)
-		memcpy(replstr.s, replacement.s, (size_t)replacement.len);
-	memcpy(replstr.s + replacement.len, word.s + prefix_len, (size_t)(word.len - prefix_len));
+static void
+cache_put(s8 word, s8 reading)
+{
+	if (g_hash_table_size(mecab.cache) >= READING_CACHE_SIZE)
+	{
+		cache_entry* oldest = mecab.least_recent;
+		cache_unlink(oldest);
+		g_hash_table_remove(mecab.cache, oldest->word.s);
+	}
 
-	buf_push(deinfs, replstr);
+	cache_entry* e = new(cache_entry, 1);
+	e->word = s8dup(word);
+	e->reading = s8dup(reading);
+	g_hash_table_insert(mecab.cache, e->word.s, e);
+	cache_push_front(e);
 }
 
 /*
- * @word: The word to be converted
- * @len_ending: The length of the ending to be disregarded
- *
- * Converts a word in あ-form to the う-form.
+ * Returns: The @n-th comma separated field of @feature, or an empty string
  */
-static void
-atou_form(s8 word, ptrdiff_t len_ending)
+static s8
+feature_field(const char* feature, int n)
 {
-	word.len -= len_ending;
-
-	IF_ENDSWITH_REPLACE("", "る");
-	IF_ENDSWITH_REPLACE("さ", "す");
-	IF_ENDSWITH_REPLACE("か", "く");
-	IF_ENDSWITH_REPLACE("が", "ぐ");
-	IF_ENDSWITH_REPLACE("ば", "ぶ");
-	IF_ENDSWITH_REPLACE("た", "つ");
-	IF_ENDSWITH_REPLACE("ま", "む");
-	IF_ENDSWITH_REPLACE("わ", "う");
-	IF_ENDSWITH_REPLACE("な", "ぬ");
-	IF_ENDSWITH_REPLACE("ら", "る");
-
-	word.len += len_ending;
+	for (; n > 0 && feature; n--)
+	{
+		feature = strchr(feature, ',');
+		if (feature)
+			feature++;
+	}
+	if (!feature)
+		return (s8){ 0 };
+	const char* end = strchr(feature, ',');
+	return (s8){ .s = (u8*)feature, .len = end ? end - feature : (size)strlen(feature) };
 }
 
 /*
- * @word: The word to be converted
- * @len_ending: The length of the ending to be disregarded
- *
- * Converts a word in い-form to the う-form.
+ * Expects @mecab.lock to be held and the tagger to be created.
  */
-static void
-itou_form(s8 word, ptrdiff_t len_ending)
+static s8
+tag_reading(s8 word)
 {
-	word.len -= len_ending;
-
-	IF_ENDSWITH_REPLACE("", "る"); // Word can alway be a る-verb, e.g. 生きます
-	IF_ENDSWITH_REPLACE("し", "す");
-	IF_ENDSWITH_REPLACE("き", "く");
-	IF_ENDSWITH_REPLACE("ぎ", "ぐ");
-	IF_ENDSWITH_REPLACE("び", "ぶ");
-	IF_ENDSWITH_REPLACE("ち", "つ");
-	IF_ENDSWITH_REPLACE("み", "む");
-	IF_ENDSWITH_REPLACE("い", "う");
-	IF_ENDSWITH_REPLACE("に", "ぬ");
-	IF_ENDSWITH_REPLACE("り", "る");
-
-	word.len += len_ending;
+	u8* reading = 0;
+	const mecab_node_t* node = mecab_sparse_tonode2(mecab.tagger, (char*)word.s, (size_t)word.len);
+	for (; node; node = node->next)
+	{
+		if (node->stat != MECAB_NOR_NODE && node->stat != MECAB_UNK_NODE)
+			continue;
+
+		// Unknown words have no reading and are kept as they are
+		s8 r = feature_field(node->feature, IPADIC_READING_FIELD);
+		if (!r.len || s8equals(r, s8("*")))
+			r = (s8){ .s = (u8*)node->surface, .len = node->length };
+		for (size i = 0; i < r.len; i++)
+			buf_push(reading, r.s[i]);
+	}
+
+	s8 ret = s8dup((s8){ .s = reading, .len = (size)buf_size(reading) });
+	buf_free(reading);
+	kata2hira_inplace(ret);
+	return ret;
 }
 
-static void
-kanjify(s8 word)
+/*
+ * Expects @mecab.lock to be held.
+ */
+static s8
+kanji2hira_locked(s8 input)
 {
-	IF_STARTSWITH_REPLACE("ご", "御");
-	IF_STARTSWITH_REPLACE("お", "御");
+	if (mecab.unavailable)
+		return (s8){ 0 };
+	if (!mecab.tagger)
+	{
+		if (!(mecab.tagger = mecab_new2("")))
+		{
+			error_msg("Could not create a MeCab tagger: %s", mecab_strerror(NULL));
+			mecab.unavailable = true;
+			return (s8){ 0 };
+		}
+		mecab.cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, cache_entry_free);
+	}
+
+	// The key needs to be null-terminated
+	s8 key = s8dup(input);
+	cache_entry* e = g_hash_table_lookup(mecab.cache, key.s);
+	frees8(&key);
+	if (e)
+	{
+		cache_unlink(e);
+		cache_push_front(e);
+		return s8dup(e->reading);
+	}
 
-	IF_ENDSWITH_REPLACE("ない", "無い");
-	IF_ENDSWITH_REPLACE("なし", "無し");
-	IF_ENDSWITH_REPLACE("つく", "付く");
+	s8 reading = tag_reading(input);
+	cache_put(input, reading);
+	return reading;
 }
 
-static void
-check_te(s8 word)
+s8
+kanji2hira(s8 input)
 {
-	/* exceptions */
-	IF_EQUALS_ADD("きて", "来る");
-	IF_ENDSWITH_REPLACE("来て", "来る");
-	IF_EQUALS_ADD("いって", "行く");
-	IF_ENDSWITH_REPLACE("行って", "行く");
-	/* ----------- */
-
-	IF_ENDSWITH_REPLACE("して", "する", "す");
-	IF_ENDSWITH_REPLACE("いて", "く");
-	IF_ENDSWITH_REPLACE("いで", "ぐ");
-	IF_ENDSWITH_REPLACE("んで", "む", "ぶ", "ぬ");
-	IF_ENDSWITH_REPLACE("って", "る", "う", "つ");
-	IF_ENDSWITH_REPLACE("て", "る");
+	STATS_START(start);
+	g_mutex_lock(&mecab.lock);
+	s8 reading = kanji2hira_locked(input);
+	g_mutex_unlock(&mecab.lock);
+	STATS_STOP(STAT_KANJI2HIRA, start);
+	return reading;
 }
 
-static void
-check_past(s8 word)
+void
+kanji2hira_batch(s8* words, size n, s8* readings)
 {
-	/* exceptions */
-	IF_EQUALS_ADD("した", "為る");
-	IF_EQUALS_ADD("きた", "来る");
-	IF_EQUALS_ADD("来た", "来る");
-	IF_EQUALS_ADD("いった", "行く");
-	IF_ENDSWITH_REPLACE("行った", "行く");
-	/* ----------- */
-
-	IF_ENDSWITH_REPLACE("した", "す");
-	IF_ENDSWITH_REPLACE("いた", "く");
-	IF_ENDSWITH_REPLACE("いだ", "ぐ");
-	IF_ENDSWITH_REPLACE("んだ", "む", "ぶ", "ぬ");
-	IF_ENDSWITH_REPLACE("った", "る", "う", "つ");
-	IF_ENDSWITH_REPLACE("た", "る");
+	g_mutex_lock(&mecab.lock);
+	for (size i = 0; i < n; i++)
+		readings[i] = kanji2hira_locked(words[i]);
+	g_mutex_unlock(&mecab.lock);
 }
+/* -------------------- End kanji2hira -------------------- */
 
-static void
-check_masu(s8 word)
+/*
+ * The deinflection rules. Suffix rules are matched through a trie over the
+ * reversed UTF-8 bytes of all suffixes, see match_suffixes(), so the cost of
+ * deinflecting a word does not grow with the number of rules.
+ */
+typedef enum {
+	SUFFIX, // Replaces the ending @from with @to
+	WORD,   // Replaces the word @from with @to, if it is the whole word
+	PREFIX, // Replaces the beginning @from with @to
+	ATOU,   // Removes the ending @from and converts the rest from あ-form to う-form
+	ITOU,   // Removes the ending @from and converts the rest from い-form to う-form
+	STEM,   // Like ITOU, but only tried if no other rule applies
+} rule_kind;
+
+typedef struct {
+	rule_kind kind;
+	const char* from;
+	const char* to;
+} rule;
+
+static const rule rules[] = {
+	/* shimau */
+	{ SUFFIX, "しまう", "" },
+	{ SUFFIX, "ちゃう", "る" },
+	{ SUFFIX, "いじゃう", "ぐ" },
+	{ SUFFIX, "いちゃう", "く" },
+	{ SUFFIX, "しちゃう", "す" },
+	{ SUFFIX, "んじゃう", "む" },
+
+	/* adjective */
+	{ SUFFIX, "よくて", "いい" },
+	{ SUFFIX, "かった", "い" },
+	{ SUFFIX, "くない", "い" },
+	{ SUFFIX, "くて", "い" },
+	{ SUFFIX, "そう", "い" },
+	{ SUFFIX, "さ", "い" },
+	{ SUFFIX, "げ", "い" },
+	{ SUFFIX, "く", "い" },
+
+	/* masu */
+	{ ITOU, "ます", 0 },
+	{ ITOU, "ません", 0 },
+
+	/* passive / causative */
+	{ SUFFIX, "られる", "る" },
+	{ SUFFIX, "させる", "る" },
+	{ ATOU, "れる", 0 },
+	{ ATOU, "せる", 0 },
+
+	/* volitional */
+	{ ITOU, "たい", 0 },
+
+	/* negation */
+	{ WORD, "ない", "ある" },
+	{ ATOU, "ない", 0 },
+	{ ATOU, "ねぇ", 0 },
+	{ ATOU, "ず", 0 },
+
+	/* te-form */
+	{ WORD, "きて", "来る" },
+	{ SUFFIX, "来て", "来る" },
+	{ WORD, "いって", "行く" },
+	{ SUFFIX, "行って", "行く" },
+	{ SUFFIX, "して", "する" },
+	{ SUFFIX, "して", "す" },
+	{ SUFFIX, "いて", "く" },
+	{ SUFFIX, "いで", "ぐ" },
+	{ SUFFIX, "んで", "む" },
+	{ SUFFIX, "んで", "ぶ" },
+	{ SUFFIX, "んで", "ぬ" },
+	{ SUFFIX, "って", "る" },
+	{ SUFFIX, "って", "う" },
+	{ SUFFIX, "って", "つ" },
+	{ SUFFIX, "て", "る" },
+
+	/* past */
+	{ WORD, "した", "為る" },
+	{ WORD, "きた", "来る" },
+	{ WORD, "来た", "来る" },
+	{ WORD, "いった", "行く" },
+	{ SUFFIX, "行った", "行く" },
+	{ SUFFIX, "した", "す" },
+	{ SUFFIX, "いた", "く" },
+	{ SUFFIX, "いだ", "ぐ" },
+	{ SUFFIX, "んだ", "む" },
+	{ SUFFIX, "んだ", "ぶ" },
+	{ SUFFIX, "んだ", "ぬ" },
+	{ SUFFIX, "った", "る" },
+	{ SUFFIX, "った", "う" },
+	{ SUFFIX, "った", "つ" },
+	{ SUFFIX, "た", "る" },
+
+	/* potential */
+	{ WORD, "できる", "為る" },
+	{ WORD, "こられる", "来る" },
+	{ SUFFIX, "せる", "す" },
+	{ SUFFIX, "ける", "く" },
+	{ SUFFIX, "べる", "ぶ" },
+	{ SUFFIX, "てる", "つ" },
+	{ SUFFIX, "める", "む" },
+	{ SUFFIX, "れる", "る" },
+	{ SUFFIX, "ねる", "ぬ" },
+	{ SUFFIX, "える", "う" },
+
+	/* conditional */
+	{ SUFFIX, "せば", "す" },
+	{ SUFFIX, "けば", "く" },
+	{ SUFFIX, "げば", "ぐ" },
+	{ SUFFIX, "べば", "ぶ" },
+	{ SUFFIX, "てば", "つ" },
+	{ SUFFIX, "めば", "む" },
+	{ SUFFIX, "えば", "う" },
+	{ SUFFIX, "ねば", "ぬ" },
+	{ SUFFIX, "れば", "る" },
+
+	/* concurrent */
+	{ ITOU, "ながら", 0 },
+
+	/* kanjify */
+	{ PREFIX, "ご", "御" },
+	{ PREFIX, "お", "御" },
+	{ SUFFIX, "ない", "無い" },
+	{ SUFFIX, "なし", "無し" },
+	{ SUFFIX, "つく", "付く" },
+
+	/* stem form */
+	// TODO: Is there a stem form which gets wrongly deinflected by the rules above?
+	{ STEM, "", 0 },
+};
+
+/* The endings an ATOU or ITOU rule is combined with, and their replacement */
+static const char* const atou_endings[][2] = {
+	{ "", "る" },
+	{ "さ", "す" },
+	{ "か", "く" },
+	{ "が", "ぐ" },
+	{ "ば", "ぶ" },
+	{ "た", "つ" },
+	{ "ま", "む" },
+	{ "わ", "う" },
+	{ "な", "ぬ" },
+	{ "ら", "る" },
+};
+
+static const char* const itou_endings[][2] = {
+	{ "", "る" }, // Word can alway be a る-verb, e.g. 生きます
+	{ "し", "す" },
+	{ "き", "く" },
+	{ "ぎ", "ぐ" },
+	{ "び", "ぶ" },
+	{ "ち", "つ" },
+	{ "み", "む" },
+	{ "い", "う" },
+	{ "に", "ぬ" },
+	{ "り", "る" },
+};
+
+/* A suffix rule, with ATOU and ITOU rules expanded into one per ending */
+typedef struct {
+	s8 suffix;
+	s8 replacement;
+	i32 rule; // Index into rules[]
+	i32 next; // Next suffix rule ending in the same trie node, -1 if none
+} suffix_rule;
+
+typedef struct {
+	u8 byte;
+	i32 child;    // First child, -1 if none
+	i32 sibling;  // Next child of the same parent, -1 if none
+	i32 suffixes; // First suffix rule ending here, -1 if none
+} trie_node;
+
+static suffix_rule* suffix_rules = 0;
+static trie_node* trie = 0; // trie[0] is the root
+static gsize trie_built = 0;
+
+#define MAX_MATCHES 64
+
+static i32
+trie_child(i32 node, u8 byte)
 {
-	IF_ENDSWITH_CONVERT_ITOU("ます");
-	IF_ENDSWITH_CONVERT_ITOU("ません");
+	for (i32 c = trie[node].child; c != -1; c = trie[c].sibling)
+	{
+		if (trie[c].byte == byte)
+			return c;
+	}
+	return -1;
 }
 
 static void
-check_shimau(s8 word)
+trie_insert(s8 suffix, s8 replacement, i32 rule)
 {
-	IF_ENDSWITH_REPLACE("しまう", "");
-	IF_ENDSWITH_REPLACE("ちゃう", "る");
-	IF_ENDSWITH_REPLACE("いじゃう", "ぐ");
-	IF_ENDSWITH_REPLACE("いちゃう", "く");
-	IF_ENDSWITH_REPLACE("しちゃう", "す");
-	IF_ENDSWITH_REPLACE("んじゃう", "む");
+	i32 node = 0;
+	for (size i = suffix.len - 1; i >= 0; i--)
+	{
+		i32 c = trie_child(node, suffix.s[i]);
+		if (c == -1)
+		{
+			c = (i32)buf_size(trie);
+			trie_node child = { .byte = suffix.s[i], .child = -1,
+					    .sibling = trie[node].child, .suffixes = -1 };
+			buf_push(trie, child);
+			trie[node].child = c;
+		}
+		node = c;
+	}
+
+	i32 idx = (i32)buf_size(suffix_rules);
+	suffix_rule sr = { .suffix = suffix, .replacement = replacement, .rule = rule, .next = -1 };
+	buf_push(suffix_rules, sr);
+
+	i32* link = &trie[node].suffixes;
+	while (*link != -1)
+		link = &suffix_rules[*link].next;
+	*link = idx;
 }
 
 static void
-check_passive_causative(s8 word)
+trie_insert_expanded(const char* const endings[][2], size n_endings, s8 from, i32 rule)
 {
-	IF_ENDSWITH_REPLACE("られる", "る");
-	IF_ENDSWITH_REPLACE("させる", "る");
-	IF_ENDSWITH_CONVERT_ATOU("れる");
-	IF_ENDSWITH_CONVERT_ATOU("せる");
+	for (size i = 0; i < n_endings; i++)
+	{
+		s8 suffix = s8concat(fromcstr_((char*)endings[i][0]), from);
+		trie_insert(suffix, fromcstr_((char*)endings[i][1]), rule);
+	}
 }
 
+/*
+ * Builds the suffix trie on first use. It is kept for the whole runtime.
+ */
 static void
-check_adjective(s8 word)
+build_trie(void)
 {
-	IF_ENDSWITH_REPLACE("よくて", "いい");
-	IF_ENDSWITH_REPLACE("かった", "い");
-	IF_ENDSWITH_REPLACE("くない", "い");
-	IF_ENDSWITH_REPLACE("くて", "い");
-	IF_ENDSWITH_REPLACE("そう", "い");
-	IF_ENDSWITH_REPLACE("さ", "い");
-	IF_ENDSWITH_REPLACE("げ", "い");
-	IF_ENDSWITH_REPLACE("く", "い");
+	if (!g_once_init_enter(&trie_built))
+		return;
+
+	trie_node root = { .child = -1, .sibling = -1, .suffixes = -1 };
+	buf_push(trie, root);
+
+	for (i32 r = 0; r < countof(rules); r++)
+	{
+		s8 from = fromcstr_((char*)rules[r].from);
+		s8 to = fromcstr_((char*)rules[r].to);
+		switch (rules[r].kind)
+		{
+			case SUFFIX:
+			case WORD:
+				trie_insert(from, to, r);
+				break;
+			case ATOU:
+				trie_insert_expanded(atou_endings, countof(atou_endings), from, r);
+				break;
+			case ITOU:
+			case STEM:
+				trie_insert_expanded(itou_endings, countof(itou_endings), from, r);
+				break;
+			case PREFIX:
+				break;
+		}
+	}
+
+	g_once_init_leave(&trie_built, 1);
 }
 
-static void
-check_volitional(s8 word)
+static int
+cmp_i32(const void* a, const void* b)
 {
-	IF_ENDSWITH_CONVERT_ITOU("たい");
+	i32 x = *(const i32*)a, y = *(const i32*)b;
+	return (x > y) - (x < y);
 }
 
-static void
-check_negation(s8 word)
+enum {
+	MAX_CANDIDATES = 256,
+	HASH_SLOTS = 2 * MAX_CANDIDATES, // Power of two
+};
+
+/* The state of a single deinflect() call */
+typedef struct {
+	arena* a;
+	deinflection* items;
+	size len;
+	i32* slots; // Open addressing hash set of indices into @items, -1 if empty
+} candidates;
+
+static u64
+hash_s8(s8 s)
 {
-	IF_EQUALS_ADD("ない", "ある");
-	IF_ENDSWITH_CONVERT_ATOU("ない");
-	IF_ENDSWITH_CONVERT_ATOU("ねぇ");
-	IF_ENDSWITH_CONVERT_ATOU("ず");
+	u64 h = 0xcbf29ce484222325; // FNV-1a
+	for (size i = 0; i < s.len; i++)
+		h = (h ^ s.s[i]) * 0x100000001b3;
+	return h;
 }
 
-static void
-check_potential(s8 word)
+/*
+ * Returns: The slot of @word, which is -1 if it is no candidate yet
+ */
+static i32*
+find_slot(candidates* c, s8 word)
 {
-	/* Exceptions */
-	IF_EQUALS_ADD("できる", "為る");
-	IF_EQUALS_ADD("こられる", "来る");
-	/* ---------- */
-
-	IF_ENDSWITH_REPLACE("せる", "す");
-	IF_ENDSWITH_REPLACE("ける", "く");
-	IF_ENDSWITH_REPLACE("べる", "ぶ");
-	IF_ENDSWITH_REPLACE("てる", "つ");
-	IF_ENDSWITH_REPLACE("める", "む");
-	IF_ENDSWITH_REPLACE("れる", "る");
-	IF_ENDSWITH_REPLACE("ねる", "ぬ");
-	IF_ENDSWITH_REPLACE("える", "う");
+	for (u64 i = hash_s8(word);; i++)
+	{
+		i32* slot = &c->slots[i & (HASH_SLOTS - 1)];
+		if (*slot == -1 || s8equals(c->items[*slot].word, word))
+			return slot;
+	}
 }
 
+/**
+ * add_candidate:
+ * @head: The part of the parent word that is kept in front
+ * @middle: The replacement
+ * @tail: The part of the parent word that is kept at the end
+ *
+ * Adds the concatenation of the three parts as a candidate unless it is
+ * one already.
+ */
 static void
-check_conditional(s8 word)
+add_candidate(candidates* c, s8 head, s8 middle, s8 tail, i32 parent, i32 rule)
 {
-	IF_ENDSWITH_REPLACE("せば", "す");
-	IF_ENDSWITH_REPLACE("けば", "く");
-	IF_ENDSWITH_REPLACE("げば", "ぐ");
-	IF_ENDSWITH_REPLACE("べば", "ぶ");
-	IF_ENDSWITH_REPLACE("てば", "つ");
-	IF_ENDSWITH_REPLACE("めば", "む");
-	IF_ENDSWITH_REPLACE("えば", "う");
-	IF_ENDSWITH_REPLACE("ねば", "ぬ");
-	IF_ENDSWITH_REPLACE("れば", "る");
+	if (c->len == MAX_CANDIDATES)
+		return;
+
+	// The word is built in place and given back if it is a duplicate.
+	// Like at MAX_CANDIDATES, candidates stop where the arena ends.
+	u8* mark = c->a->beg;
+	s8 word = { .len = head.len + middle.len + tail.len };
+	word.s = tryanew(c->a, u8, word.len);
+	if (!word.s)
+		return;
+	s8copy(s8copy(s8copy(word, head), middle), tail);
+
+	i32* slot = find_slot(c, word);
+	if (*slot != -1)
+	{
+		c->a->beg = mark;
+		return;
+	}
+
+	*slot = (i32)c->len;
+	c->items[c->len++] = (deinflection){
+		.word = word,
+		.parent = parent,
+		.rule = rule,
+		.depth = parent == -1 ? 0 : c->items[parent].depth + 1,
+	};
 }
 
+/*
+ * Adds the deinflections of all suffix rules matching candidate @idx in a
+ * single backwards walk through the trie. With @stem only STEM rules are
+ * applied, otherwise all others.
+ */
 static void
-check_concurrent(s8 word)
+match_suffixes(candidates* c, i32 idx, bool stem)
 {
-	IF_ENDSWITH_CONVERT_ITOU("ながら");
+	s8 word = c->items[idx].word;
+	i32 matches[MAX_MATCHES];
+	int n_matches = 0;
+
+	i32 node = 0;
+	for (size i = word.len; node != -1; i--)
+	{
+		for (i32 sr = trie[node].suffixes; sr != -1; sr = suffix_rules[sr].next)
+		{
+			rule_kind kind = rules[suffix_rules[sr].rule].kind;
+			if ((kind == STEM) != stem || (kind == WORD && i != 0))
+				continue;
+
+			assert(n_matches < MAX_MATCHES);
+			if (n_matches < MAX_MATCHES)
+				matches[n_matches++] = sr;
+		}
+		if (i == 0)
+			break;
+		node = trie_child(node, word.s[i - 1]);
+	}
+
+	// Suffix rules are numbered in table order
+	qsort(matches, (size_t)n_matches, sizeof(*matches), cmp_i32);
+	for (int m = 0; m < n_matches; m++)
+	{
+		suffix_rule sr = suffix_rules[matches[m]];
+		s8 head = { .s = word.s, .len = word.len - sr.suffix.len };
+		add_candidate(c, head, sr.replacement, (s8){ 0 }, idx, sr.rule);
+	}
 }
 
 static void
-deinflect_one_iter(s8 word)
+match_prefixes(candidates* c, i32 idx)
+{
+	s8 word = c->items[idx].word;
+	for (i32 r = 0; r < countof(rules); r++)
+	{
+		if (rules[r].kind != PREFIX)
+			continue;
+
+		s8 from = fromcstr_((char*)rules[r].from);
+		if (word.len >= from.len && !u8compare(word.s, from.s, from.len))
+		{
+			s8 tail = { .s = word.s + from.len, .len = word.len - from.len };
+			add_candidate(c, (s8){ 0 }, fromcstr_((char*)rules[r].to), tail, idx, r);
+		}
+	}
+}
+
+deinflections
+deinflect(s8 word, arena* a)
 {
-	check_shimau(word);
-	check_adjective(word);
-	check_masu(word);
-	check_passive_causative(word);
-	check_volitional(word);
-	check_negation(word);
-	check_te(word);
-	check_past(word);
-	check_potential(word);
-	check_conditional(word);
-	check_concurrent(word);
-	kanjify(word);
+	build_trie();
+
+	u8* mark = a->beg;
+	candidates c = {
+		.a = a,
+		.items = tryanew(a, deinflection, MAX_CANDIDATES),
+		.slots = tryanew(a, i32, HASH_SLOTS),
+	};
+	if (!c.items || !c.slots)
+	{
+		a->beg = mark;
+		return (deinflections){ 0 };
+	}
+	memset(c.slots, 0xff, HASH_SLOTS * sizeof(*c.slots));
+
+	add_candidate(&c, word, (s8){ 0 }, (s8){ 0 }, -1, -1);
+	for (i32 i = 0; i < c.len; i++)
+	{
+		match_suffixes(&c, i, false);
+		match_prefixes(&c, i);
+	}
+
+	if (c.len == 1)
+		match_suffixes(&c, 0, true);
+
+	return (deinflections){ .items = c.items, .len = c.len };
 }
 
-s8*
-deinflect(s8 word)
+s8
+deinflect_rule_pattern(i32 rule)
 {
-	deinfs = NULL;
-	deinflect_one_iter(word);
-	for (size_t i = 0; i < buf_size(deinfs); i++)
-		deinflect_one_iter(deinfs[i]);
-	
-	// Checking for stem form
-	// TODO: Is there a stem form which gets wrongly deinflected above?
-	if (buf_size(deinfs) == 0)
-		itou_form(word, 0);
-
-	return deinfs;
+	assert(rule >= 0 && rule < countof(rules));
+	return fromcstr_((char*)rules[rule].from);
 }
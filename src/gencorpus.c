@@ -0,0 +1,87 @@
+/*
+ * Writes a synthetic audio directory in the ajt format, so that the index
+ * build and lookups can be measured offline at any scale.
+ *
+ * Usage: jppron-gen [-s sources] [-n headwords per source] [-f max files per headword]
+ *                   [-m min morae] [-M max morae] [-S percent shared headwords]
+ *                   [-k percent katakana readings] [-r seed] [-a] dir
+ *
+ * With -a, a placeholder audio file is written for every file. Point jppron
+ * at the directory by setting XDG_DATA_HOME to its parent and naming it
+ * ajt_japanese_audio.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h> // getopt
+#include <sys/stat.h>
+
+#include "util.h"
+#include "corpus.h"
+
+static long
+number_arg(int opt, const char* arg, long min, long max)
+{
+    char* end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || n < min || n > max)
+	fatal("-%c expects a number between %ld and %ld.", opt, min, max);
+    return n;
+}
+
+int
+main(int argc, char** argv)
+{
+    corpus_params p = corpus_defaults();
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:f:m:M:S:k:r:a")) != -1)
+    {
+	switch (opt)
+	{
+	case 's':
+	    p.sources = number_arg(opt, optarg, 1, 256);
+	    break;
+	case 'n':
+	    p.headwords = number_arg(opt, optarg, 1, LONG_MAX);
+	    break;
+	case 'f':
+	    p.max_files = (i32)number_arg(opt, optarg, 1, 255);
+	    break;
+	case 'm':
+	    p.min_morae = (i32)number_arg(opt, optarg, 1, CORPUS_MAX_MORAE);
+	    break;
+	case 'M':
+	    p.max_morae = (i32)number_arg(opt, optarg, 1, CORPUS_MAX_MORAE);
+	    break;
+	case 'S':
+	    p.shared_percent = (i32)number_arg(opt, optarg, 0, 100);
+	    break;
+	case 'k':
+	    p.katakana_percent = (i32)number_arg(opt, optarg, 0, 100);
+	    break;
+	case 'r':
+	    p.seed = (u64)number_arg(opt, optarg, 0, LONG_MAX);
+	    break;
+	case 'a':
+	    p.media = true;
+	    break;
+	default:
+	    fatal("Usage: %s [-s sources] [-n headwords] [-f max files] [-m min morae] "
+		  "[-M max morae] [-S percent shared] [-k percent katakana] [-r seed] [-a] dir", argv[0]);
+	}
+    }
+    if (optind != argc - 1)
+	fatal("Usage: %s [options] dir", argv[0]);
+
+    char* dir = argv[optind];
+    if (mkdir(dir, S_IRWXU) && errno != EEXIST)
+	fatal_perror("Creating directory");
+
+    size records = write_corpus(dir, p);
+    msg("Wrote %td records of %td sources to %s.", records, p.sources, dir);
+    return EXIT_SUCCESS;
+}
@@ -4,7 +4,8 @@
 #include <dirent.h>
 #include <unistd.h> // access
 #include <alloca.h>
-#include <sys/stat.h> // mkdir
+#include <limits.h>
+#include <sys/stat.h> // mkdir, stat, fstatat
 
 #include <glib.h>
 
@@ -13,6 +14,10 @@
 #include "deinflector.h"
 #include "util.h"
 #include "platformdep.h"
+#include "daemon.h"
+#include "audio.h"
+#include "pcmcache.h"
+#include "stats.h"
 
 // For access()
 #ifdef _WIN32
@@ -26,8 +31,49 @@ typedef struct {
     s8 hira_reading;
     s8 pitch_number;
     s8 pitch_pattern;
+    i32 pitch; // pitch_number parsed, -1 if unknown
 } fileinfo;
 
+/*
+ * Binary fileinfo record as stored in dbi2:
+ *   u8 version, u8 source id, u8 pitch (PITCH_UNKNOWN if not a number), u8 reserved,
+ *   followed by reading, pitch number and pitch pattern, each prefixed
+ *   with its length as u16 little-endian.
+ */
+enum {
+    FILEINFO_VERSION = 1,
+    FILEINFO_HEADER_LEN = 4,
+    PITCH_UNKNOWN = 0xFF,
+    MAX_LISTED_PITCHES = 8, // Of a file in the pitch index, see parse_pitches()
+    MAX_SOURCES = 256,
+    MAX_DEINFLECT_LEN = 128, // In bytes, see find_deinflected()
+};
+
+typedef struct {
+    s8 key;
+    s8 val;
+} record;
+
+/*
+ * The records of a single source directory. Filled and sorted by a worker
+ * thread and then written to the database by the main thread.
+ */
+typedef struct {
+    size order; // Position of the source in the sorted directory listing, used as source id
+    s8 curdir;
+    s8 dirname; // Name of the source directory below the audio directory
+    s8 name;
+    s8 mediadir;
+    char* map; // The mapped index file, which most strings point into
+    size_t maplen;
+    s8* strings; // Strings owned by the batch
+    record* filenames; // headword -> file reference
+    record* fileinfos; // file reference -> fileinfo
+    record* readings; // readingkey() -> file reference
+    record* pitches; // pitchkey() -> file reference
+    sourcemeta meta; // Of the index file
+} indexbatch;
+
 const char json_typename[][16] = {
     [JSON_ERROR] = "ERROR",
     [JSON_DONE] = "DONE",
@@ -53,19 +99,15 @@ print_fileinfo(fileinfo fi)
 	   (int)fi.pitch_pattern.len, (char*)fi.pitch_pattern.s);
 }
 
-static void
-freefileinfo(fileinfo fi[static 1])
-{
-    /* frees8(&fi->origin); */
-    frees8(&fi->hira_reading);
-    frees8(&fi->pitch_number);
-    frees8(&fi->pitch_pattern);
-}
-
+/*
+ * Returns: The full path of the file referred to by @fileref, which needs to be freed.
+ */
 static s8
-build_audio_path(s8 indexdir, s8 audiofn)
+build_audio_path(s8 audiodir, s8 fileref)
 {
-    return buildpath(indexdir, s8("media"), audiofn);
+    source src = getsource(fileref.s[0]);
+    s8 fn = { .s = fileref.s + 1, .len = fileref.len - 1 };
+    return buildpath(audiodir, src.dir, src.mediadir, fn);
 }
 
 static void
@@ -76,19 +118,154 @@ prints8(s8 z)
     putchar('\n');
 }
 
+/*
+ * Returns @str with the lifetime of the batch. Slices into the mapped
+ * index file already have it, anything else is copied.
+ */
+static s8
+keep(indexbatch* b, s8 str)
+{
+    if (str.s >= (u8*)b->map && str.s + str.len <= (u8*)b->map + b->maplen)
+	return str;
+
+    s8 r = s8dup(str);
+    buf_push(b->strings, r);
+    return r;
+}
+
+/*
+ * Returns: The reference to the media file @fn as it is stored in the database,
+ *          i.e. the source id followed by the file name. Paths are built from
+ *          it at lookup time, so the audio directory is free to move.
+ */
+static s8
+add_fileref(indexbatch* b, s8 fn)
+{
+    s8 ref = news8(1 + fn.len);
+    ref.s[0] = (u8)b->order;
+    u8copy(ref.s + 1, fn.s, fn.len);
+    buf_push(b->strings, ref);
+    return ref;
+}
+
+/*
+ * @headw and @fileref need to live as long as the batch
+ */
+static void
+add_filename(indexbatch* b, s8 headw, s8 fileref)
+{
+    buf_push(b->filenames, ((record){ headw, fileref }));
+}
+
+static u8
+parse_pitch(s8 pitch_number)
+{
+    i32 pitch = 0;
+    size i = 0;
+    for (; i < pitch_number.len && pitch_number.s[i] >= '0' && pitch_number.s[i] <= '9'; i++)
+    {
+	pitch = pitch * 10 + (pitch_number.s[i] - '0');
+	if (pitch >= PITCH_UNKNOWN)
+	    return PITCH_UNKNOWN;
+    }
+    return i > 0 ? (u8)pitch : PITCH_UNKNOWN;
+}
+
+/*
+ * Stores the distinct accents listed in @pitch_number, e.g. "0,2" or "1-3",
+ * in @pitches, skipping those that do not fit in a u8.
+ *
+ * Returns: Their number
+ */
+static int
+parse_pitches(s8 pitch_number, u8 pitches[static MAX_LISTED_PITCHES])
+{
+    int n = 0;
+    for (size i = 0; i < pitch_number.len && n < MAX_LISTED_PITCHES;)
+    {
+	if (pitch_number.s[i] < '0' || pitch_number.s[i] > '9')
+	{
+	    i++;
+	    continue;
+	}
+	i32 pitch = 0;
+	for (; i < pitch_number.len && pitch_number.s[i] >= '0' && pitch_number.s[i] <= '9'; i++)
+	    pitch = pitch < PITCH_UNKNOWN ? pitch * 10 + (pitch_number.s[i] - '0') : PITCH_UNKNOWN;
+	if (pitch >= PITCH_UNKNOWN)
+	    continue;
+
+	bool listed = false;
+	for (int k = 0; k < n && !listed; k++)
+	    listed = pitches[k] == pitch;
+	if (!listed)
+	    pitches[n++] = (u8)pitch;
+    }
+    return n;
+}
+
+static s8
+put_field(s8 dst, s8 field)
+{
+    dst.s[0] = (u8)(field.len & 0xFF);
+    dst.s[1] = (u8)(field.len >> 8);
+    dst.s += 2;
+    dst.len -= 2;
+    return s8copy(dst, field);
+}
+
+static s8
+get_field(s8 src[static 1])
+{
+    if (src->len < 2)
+	return (s8){ 0 };
+    size len = src->s[0] | src->s[1] << 8;
+    if (len > src->len - 2)
+	return (s8){ 0 };
+
+    s8 field = { .s = src->s + 2, .len = len };
+    src->s += 2 + len;
+    src->len -= 2 + len;
+    return field;
+}
+
 static void
-add_filename(s8 headw, s8 fullpth)
+add_fileinfo(indexbatch* b, s8 fileref, fileinfo fi)
 {
-    addtodb1(headw, fullpth);
+    s8 fields[] = { fi.hira_reading, fi.pitch_number, fi.pitch_pattern };
+    size len = FILEINFO_HEADER_LEN;
+    for (int i = 0; i < countof(fields); i++)
+    {
+	if (fields[i].len > 0xFFFF)
+	    fields[i].len = 0xFFFF;
+	len += 2 + fields[i].len;
+    }
+
+    s8 data = news8(len);
+    data.s[0] = FILEINFO_VERSION;
+    data.s[1] = (u8)b->order;
+    data.s[2] = parse_pitch(fi.pitch_number);
+    data.s[3] = 0;
+    s8 p = { .s = data.s + FILEINFO_HEADER_LEN, .len = len - FILEINFO_HEADER_LEN };
+    for (int i = 0; i < countof(fields); i++)
+	p = put_field(p, fields[i]);
+
+    buf_push(b->strings, data);
+    buf_push(b->fileinfos, ((record){ fileref, data }));
 }
 
 static void
-add_fileinfo(s8 fullpth, fileinfo fi)
+free_batch(indexbatch* b)
 {
-    s8 sep = s8("\0");
-    s8 data = s8concat(fi.origin, sep, fi.hira_reading, sep, fi.pitch_number, sep, fi.pitch_pattern);
-    addtodb2(fullpth, data);
-    frees8(&data);
+    frees8buffer(b->strings);
+    buf_free(b->filenames);
+    buf_free(b->fileinfos);
+    buf_free(b->readings);
+    buf_free(b->pitches);
+    if (b->map)
+	unmap_file(b->map, b->maplen);
+    frees8(&b->curdir);
+    frees8(&b->dirname);
+    free(b);
 }
 
 // wrapper for json api
@@ -97,22 +274,22 @@ json_get_string_(json_stream* json)
 {
     size_t slen = 0;
     s8 r = { 0 };
-    r.s = (u8*)json_get_string(json, &slen);
-    r.len = slen > 0 ? (size)(slen - 1) : 0;  // API includes terminating 0 in length
+    r.s = (u8*)json_get_slice(json, &slen);
+    r.len = (size)slen;
     return r;
 }
 
 static void
-add_from_index(char* index_path, s8 curdir)
+add_from_index(char* index_path, indexbatch* b)
 {
-    FILE* index = fopen(index_path, "r");
-    if (!index)
+    b->map = map_file(index_path, &b->maplen);
+    if (!b->map)
 	fatal_perror("Opening index file");
     json_stream s[1];
-    json_open_stream(s, index);
+    json_open_buffer(s, b->map, b->maplen);
 
     s8 cursrc = { 0 };
-    s8 mediadir = { 0 };
+    u8* reading_buf = 0;
 
     bool reading_meta = false;
     bool reading_headwords = false;
@@ -175,13 +352,14 @@ add_from_index(char* index_path, s8 curdir)
 		{
 		    type = json_next(s);
 		    assert(type == JSON_STRING);
-		    cursrc = s8dup(json_get_string_(s));
+		    cursrc = keep(b, json_get_string_(s));
+		    b->name = cursrc;
 		}
 		else if (s8equals(value, s8("media_dir")))
 		{
 		    type = json_next(s);
 		    assert(type == JSON_STRING);
-		    mediadir = s8dup(json_get_string_(s));
+		    b->mediadir = keep(b, json_get_string_(s));
 		}
 		else
 		    json_skip(s);
@@ -206,15 +384,13 @@ add_from_index(char* index_path, s8 curdir)
 	}
 	else if (reading_headwords && type == JSON_STRING)
 	{
-	    s8 headword = s8dup(value);
+	    s8 headword = keep(b, value);
 
 	    type = json_next(s);
 	    if (type == JSON_STRING)
 	    {
 		s8 fn = json_get_string_(s);
-		s8 fullpth = buildpath(curdir, mediadir, fn);
-		add_filename(headword, fullpth);
-		frees8(&fullpth);
+		add_filename(b, headword, add_fileref(b, fn));
 	    }
 	    else if (type == JSON_ARRAY)
 	    {
@@ -226,9 +402,7 @@ add_from_index(char* index_path, s8 curdir)
 		    if (type == JSON_STRING)
 		    {
 			s8 fn = json_get_string_(s);
-			s8 fullpth = buildpath(curdir, mediadir, fn);
-			add_filename(headword, fullpth);
-			frees8(&fullpth);
+			add_filename(b, headword, add_fileref(b, fn));
 		    }
 		    else
 			error_msg("Encountered an unexpected type '%s', \
@@ -241,8 +415,6 @@ add_from_index(char* index_path, s8 curdir)
 		error_msg("Encountered unexpected type '%s' \
 				for filename of headword '%.*s'.",
 			  json_typename[type], (int)headword.len, (char*)headword.s);
-
-	    frees8(&headword);
 	}
 	else if (reading_headwords) // Warning: Order is important
 	{
@@ -269,7 +441,7 @@ add_from_index(char* index_path, s8 curdir)
 	{
 	    // TODO: Add debug check for audio filename ending (.ogg, .mp3, ...)
 	    s8 fn = value;
-	    s8 fullpth = buildpath(curdir, mediadir, fn);
+	    s8 fileref = add_fileref(b, fn);
 
 	    type = json_next(s);
 	    assert(type == JSON_OBJECT);
@@ -284,19 +456,33 @@ add_from_index(char* index_path, s8 curdir)
 		    {
 			type = json_next(s);
 			assert(type == JSON_STRING);
-			fi.hira_reading = kata2hira(json_get_string_(s));
+			// An escaped string lives in the parser's buffer, which the
+			// next escaped string overwrites
+			fi.hira_reading = keep(b, json_get_string_(s));
+			if (has_katakana(fi.hira_reading))
+			{
+			    // Converted in a buffer reused for all records, the
+			    // record is encoded before the next one is read
+			    if (buf_capacity(reading_buf) < (size_t)fi.hira_reading.len)
+				buf_trunc(reading_buf, (size_t)fi.hira_reading.len);
+			    memcpy(reading_buf, fi.hira_reading.s, (size_t)fi.hira_reading.len);
+			    fi.hira_reading.s = reading_buf;
+			    STATS_START(start);
+			    kata2hira_inplace(fi.hira_reading);
+			    STATS_STOP(STAT_KATA2HIRA, start);
+			}
 		    }
 		    else if (s8equals(value, s8("pitch_number")))
 		    {
 			type = json_next(s);
 			assert(type == JSON_STRING);
-			fi.pitch_number = s8dup(json_get_string_(s));
+			fi.pitch_number = keep(b, json_get_string_(s));
 		    }
 		    else if (s8equals(value, s8("pitch_pattern")))
 		    {
 			type = json_next(s);
 			assert(type == JSON_STRING);
-			fi.pitch_pattern = s8dup(json_get_string_(s));
+			fi.pitch_pattern = keep(b, json_get_string_(s));
 		    }
 		    else
 			json_skip(s);
@@ -314,9 +500,7 @@ add_from_index(char* index_path, s8 curdir)
 	    if (type != JSON_OBJECT_END)
 		json_skip_until(s, JSON_OBJECT_END);
 
-	    add_fileinfo(fullpth, fi);
-	    freefileinfo(&fi);
-	    frees8(&fullpth);
+	    add_fileinfo(b, fileref, fi);
 	}
 	else if (reading_files)
 	{
@@ -325,9 +509,8 @@ add_from_index(char* index_path, s8 curdir)
 	}
     }
 
-    frees8(&cursrc);
-    fclose(index);
     json_close(s);
+    buf_free(reading_buf);
 }
 
 /*
@@ -357,180 +540,1438 @@ create_dir(char* dir_path)
     return (status == 0 || errno == EEXIST) ? 0 : -1;
 }
 
-void
-jppron_create(char* audio_dir_path, s8 database_path)
+static int
+cmprecord(const void* a, const void* b)
 {
-    // TODO: Delete old db if existent
-    if (create_dir((char*)database_path.s))
-	fatal_perror("Creating directory");
+    const record* ra = a;
+    const record* rb = b;
+    i32 r = dbcmp(ra->key, rb->key);
+    return r ? r : dbcmp(ra->val, rb->val);
+}
 
-    DIR* audio_dir;
-    if ((audio_dir = opendir(audio_dir_path)) == NULL)
-	fatal_perror("Opening audio directory");
+static void
+sort_records(record* r)
+{
+    if (buf_size(r) > 1)
+	qsort(r, buf_size(r), sizeof(*r), cmprecord);
+}
 
-    opendb((char*)database_path.s, false);
+static int
+cmprecordkey(const void* a, const void* b)
+{
+    return dbcmp(((const record*)a)->key, ((const record*)b)->key);
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(audio_dir)) != NULL)
+/*
+ * Pairs every headword with the reading and pitches of each of its files for
+ * the reading and pitch indexes, with one pitch record per accent the file
+ * lists. Expects the fileinfos to be sorted.
+ */
+static void
+add_index_records(indexbatch* b)
+{
+    for (size_t i = 0; i < buf_size(b->filenames); i++)
     {
-	if (strcmp(entry->d_name, ".") == 0
-	    || strcmp(entry->d_name, "..") == 0)
+	record probe = { .key = b->filenames[i].val };
+	record* fi = 0;
+	if (buf_size(b->fileinfos) > 0)
+	    fi = bsearch(&probe, b->fileinfos, buf_size(b->fileinfos), sizeof(*fi), cmprecordkey);
+	if (!fi)
 	    continue;
 
-	s8 curdir = buildpath(fromcstr_(audio_dir_path), fromcstr_(entry->d_name));
-	s8 index_path = buildpath(curdir, s8("index.json"));
-	debug_msg("Processing path: %.*s", (int)curdir.len, (char*)curdir.s);
+	s8 d = { .s = fi->val.s + FILEINFO_HEADER_LEN, .len = fi->val.len - FILEINFO_HEADER_LEN };
+	s8 reading = get_field(&d);
+	if (!reading.len)
+	    continue;
 
-	if (access((char*)index_path.s, F_OK) == 0)
-	    add_from_index((char*)index_path.s, curdir);
-	else
-	    debug_msg("No index file found");
+	s8 key = readingkey(reading, b->filenames[i].key);
+	buf_push(b->strings, key);
+	buf_push(b->readings, ((record){ key, b->filenames[i].val }));
 
-	frees8(&curdir);
-	frees8(&index_path);
+	u8 pitches[MAX_LISTED_PITCHES];
+	int npitches = parse_pitches(get_field(&d), pitches);
+	i32 morae = npitches ? count_morae(reading) : 0;
+	for (int k = 0; k < npitches; k++)
+	{
+	    key = pitchkey(pitches[k], (u8)MIN(morae, 0xFF), reading, b->filenames[i].key);
+	    buf_push(b->strings, key);
+	    buf_push(b->pitches, ((record){ key, b->filenames[i].val }));
+	}
     }
+}
 
-    closedb();
-    closedir(audio_dir);
+/*
+ * Writes the sorted record runs @runs with a k-way merge, so that every
+ * insert is an append. With @dups, the (distinct) values of a key in all
+ * runs are added in run order, otherwise only the first one.
+ */
+static void
+merge_records(record** runs, size nruns, bool dups, void (*append)(s8 key, s8 val))
+{
+    size* pos = new(size, nruns + 1);
+    for (;;)
+    {
+	size min = -1;
+	for (size i = 0; i < nruns; i++)
+	{
+	    if ((size_t)pos[i] < buf_size(runs[i])
+		&& (min == -1 || dbcmp(runs[i][pos[i]].key, runs[min][pos[min]].key) < 0))
+		min = i;
+	}
+	if (min == -1)
+	    break;
 
-    s8 lock_file = buildpath(database_path, s8("lock.mdb"));
-    remove((char*)lock_file.s);
-    frees8(&lock_file);
+	// Runs before @min only have larger keys left
+	s8 key = runs[min][pos[min]].key;
+	s8 lastval = { 0 };
+	for (size i = min; i < nruns; i++)
+	{
+	    for (; (size_t)pos[i] < buf_size(runs[i]) && s8equals(runs[i][pos[i]].key, key); pos[i]++)
+	    {
+		s8 val = runs[i][pos[i]].val;
+		if (!lastval.s || (dups && !s8equals(val, lastval)))
+		    append(key, val);
+		lastval = val;
+	    }
+	}
+    }
+    free(pos);
 }
 
-static fileinfo
-getfileinfo(s8 fn)
+static void
+write_batches(indexbatch** batches, size nbatches)
 {
-    s8 data = getfromdb2(fn);
+    for (size i = 0; i < nbatches; i++)
+    {
+	if (batches[i]->map)
+	{
+	    source src = {
+		.name = batches[i]->name,
+		.dir = batches[i]->dirname,
+		.mediadir = batches[i]->mediadir
+	    };
+	    addsource((u8)batches[i]->order, src);
+	}
+	putsourcemeta(batches[i]->dirname, batches[i]->meta);
+    }
 
-    s8 d = data;
+    // Runs are in source id order, which keeps the values of a key sorted
+    record** runs = new(record*, nbatches + 1);
 
-    s8 data_split[4];
-    for (int i = 0; i < 3; i++)
-    {
-	data_split[i] = s8dup(fromcstr_((char*)d.s));
+    for (size i = 0; i < nbatches; i++)
+	runs[i] = batches[i]->filenames;
+    merge_records(runs, nbatches, true, appendtodb1);
 
-	d.s += data_split[i].len + 1;
-	d.len -= data_split[i].len + 1;
-	assert(d.len >= 0);
-    }
-    data_split[3] = s8dup(d);
+    for (size i = 0; i < nbatches; i++)
+	runs[i] = batches[i]->fileinfos;
+    merge_records(runs, nbatches, false, appendtodb2);
 
-    frees8(&data);
+    for (size i = 0; i < nbatches; i++)
+	runs[i] = batches[i]->readings;
+    merge_records(runs, nbatches, true, appendreading);
 
-    return (fileinfo){
-	       .origin = data_split[0],
-	       .hira_reading = data_split[1],
-	       .pitch_number = data_split[2],
-	       .pitch_pattern = data_split[3]
-    };
+    for (size i = 0; i < nbatches; i++)
+	runs[i] = batches[i]->pitches;
+    merge_records(runs, nbatches, true, appendpitch);
+
+    free(runs);
+}
+
+/*
+ * Adds the records of @b for its source, whose old records have to be
+ * deleted already, see deletesources()
+ */
+static void
+replace_source(indexbatch* b)
+{
+    u8 id = (u8)b->order;
+    if (b->map)
+    {
+	source src = { .name = b->name, .dir = b->dirname, .mediadir = b->mediadir };
+	addsource(id, src);
+    }
+    for (size_t i = 0; i < buf_size(b->filenames); i++)
+	inserttodb1(b->filenames[i].key, b->filenames[i].val);
+    for (size_t i = 0; i < buf_size(b->fileinfos); i++)
+	addtodb2(b->fileinfos[i].key, b->fileinfos[i].val);
+    for (size_t i = 0; i < buf_size(b->readings); i++)
+	insertreading(b->readings[i].key, b->readings[i].val);
+    for (size_t i = 0; i < buf_size(b->pitches); i++)
+	insertpitch(b->pitches[i].key, b->pitches[i].val);
+    putsourcemeta(b->dirname, b->meta);
+}
+
+static u64
+hash_bytes(char* data, size_t len)
+{
+    u64 h = 0xcbf29ce484222325; // FNV-1a
+    for (size_t i = 0; i < len; i++)
+	h = (h ^ (u8)data[i]) * 0x100000001b3;
+    return h;
 }
 
+/*
+ * Worker thread: Parses the index of the source directory @data into memory
+ * and hands the finished batch to the writer through the queue @user_data.
+ */
 static void
-play_word(char* word, char* reading, s8 database_path)
+index_worker(gpointer data, gpointer user_data)
 {
-    s8 hira_reading = kata2hira(fromcstr_(reading));
+    indexbatch* b = data;
+    GAsyncQueue* finished = user_data;
 
-    opendb((char*)database_path.s, true);
-    s8* files = getfiles(fromcstr_(word));
+    s8 index_path = buildpath(b->curdir, s8("index.json"));
+    debug_msg("Processing path: %.*s", (int)b->curdir.len, (char*)b->curdir.s);
 
-    if (!files)
+    if (access((char*)index_path.s, F_OK) == 0)
     {
-	msg("Nothing found.");
-	closedb();
-	return;
+	STATS_START(start);
+	add_from_index((char*)index_path.s, b);
+	STATS_STOP(STAT_JSON_PARSE, start);
+	b->meta.hash = hash_bytes(b->map, b->maplen);
     }
+    else
+	debug_msg("No index file found");
+
+    sort_records(b->filenames);
+    sort_records(b->fileinfos);
+    add_index_records(b);
+    sort_records(b->readings);
+    sort_records(b->pitches);
+
+    frees8(&index_path);
+    g_async_queue_push(finished, b);
+}
+
+/*
+ * Returns: The path of the audio cache file in the database directory @dbpth
+ */
+static s8
+build_pcmcache_path(s8 dbpth)
+{
+    return buildpath(dbpth, s8("pcmcache"));
+}
+
+static int
+cmpstringp(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * Returns: The names of the source directories in @audio_dir_path in sorted
+ *          order, which need to be freed with free_sources()
+ */
+static char**
+list_sources(char* audio_dir_path)
+{
+    DIR* audio_dir;
+    if ((audio_dir = opendir(audio_dir_path)) == NULL)
+	fatal_perror("Opening audio directory");
 
-    if (reading)
+    char** sources = 0;
+    struct dirent *entry;
+    while ((entry = readdir(audio_dir)) != NULL)
     {
-	bool match = false;
-	for (size_t i = 0; i < buf_size(files); i++)
-	{
-	    fileinfo fi = getfileinfo(files[i]);
-	    if (s8equals(hira_reading, fi.hira_reading))
-	    {
-		print_fileinfo(fi);
-		play_audio(files[i].len, (char*)files[i].s);
-		match = true;
-	    }
-	    freefileinfo(&fi);
-	}
-	if (!match)
-	{
-	    msg("Could not find an audio file with corresponding reading. Playing all..");
-	    reading = 0;
-	}
+	if (strcmp(entry->d_name, ".") == 0
+	    || strcmp(entry->d_name, "..") == 0)
+	    continue;
+	// Stray files would use up source ids, links to directories are fine
+	struct stat st;
+	if (fstatat(dirfd(audio_dir), entry->d_name, &st, 0) == -1 || !S_ISDIR(st.st_mode))
+	    continue;
+	buf_push(sources, strdup(entry->d_name));
     }
-    if (!reading)
-    {
-	// Play all
-	for (size_t i = 0; i < buf_size(files); i++)
-	{
-	    fileinfo fi = getfileinfo(files[i]);
-	    print_fileinfo(fi);
-	    freefileinfo(&fi);
+    closedir(audio_dir);
+    // Sources are written in a fixed order, so that the first source
+    // providing a headword does not depend on thread scheduling
+    size nsources = buf_size(sources);
+    if (nsources > MAX_SOURCES)
+	fatal("Too many audio sources: %td. At most %d are supported.", nsources, MAX_SOURCES);
+    if (nsources > 0)
+	qsort(sources, nsources, sizeof(*sources), cmpstringp);
+    return sources;
+}
 
-	    play_audio(files[i].len, (char*)files[i].s);
-	}
+static void
+free_sources(char** sources)
+{
+    while (buf_size(sources) > 0)
+	free(buf_pop(sources));
+    buf_free(sources);
+}
+
+/*
+ * Returns: A new batch for the source directory @dirname with the state of
+ *          its index file
+ */
+static indexbatch*
+new_batch(char* audio_dir_path, char* dirname, size order)
+{
+    indexbatch* b = new(indexbatch, 1);
+    b->order = order;
+    b->dirname = s8dup(fromcstr_(dirname));
+    b->curdir = buildpath(fromcstr_(audio_dir_path), b->dirname);
+    b->meta.id = (u8)order;
+
+    s8 index_path = buildpath(b->curdir, s8("index.json"));
+    struct stat st;
+    if (stat((char*)index_path.s, &st) == 0)
+    {
+	b->meta.mtime = (i64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	b->meta.size = (i64)st.st_size;
     }
+    frees8(&index_path);
+    return b;
+}
 
-    frees8buffer(files);
-    closedb();
+static GThreadPool*
+new_index_pool(GAsyncQueue* finished, size nsources)
+{
+    GError* error = NULL;
+    GThreadPool* pool = g_thread_pool_new(index_worker, finished,
+					  MAX(1, MIN((size)g_get_num_processors(), nsources)),
+					  TRUE, &error);
+    if (!pool)
+	fatal("Could not create index threads: %s", error->message);
+    return pool;
 }
 
+/*
+ * Returns: A new empty directory next to the database at @database_path,
+ *          which the database is written to before it replaces the live one
+ */
 static s8
-build_database_path()
+new_build_dir(s8 database_path)
 {
-    return fromcstr_(g_build_filename(g_get_user_data_dir(), "jppron", NULL));
+    s8 dir = buildpath(database_path, s8("build.XXXXXX"));
+    if (!mkdtemp((char*)dir.s))
+	fatal_perror("Creating build directory");
+    return dir;
+}
+
+/*
+ * Commits the database being written in @builddir and, if it is to @replace
+ * the one at @database_path, renames a compacted copy of it into place.
+ * Readers keep the file they opened and the daemon reopens on its next
+ * request, so lookups never see a partially written database. If sources
+ * @changed, the audio cache is dropped, since it might refer to old files.
+ */
+static void
+finish_write(s8 database_path, s8 builddir, bool replace, bool changed)
+{
+    s8 compactdir = buildpath(builddir, s8("compact"));
+    if (replace)
+    {
+	if (create_dir((char*)compactdir.s))
+	    fatal_perror("Creating directory");
+	compactdb((char*)compactdir.s);
+    }
+    closedb();
+
+    s8 build_files[] = { s8("data.mdb"), s8("lock.mdb") };
+    for (int i = 0; i < countof(build_files); i++)
+    {
+	s8 path = buildpath(builddir, build_files[i]);
+	remove((char*)path.s);
+	frees8(&path);
+    }
+
+    if (replace)
+    {
+	s8 compact_file = buildpath(compactdir, s8("data.mdb"));
+	s8 dbfile = buildpath(database_path, s8("data.mdb"));
+	if (rename((char*)compact_file.s, (char*)dbfile.s))
+	    fatal_perror("Replacing database");
+	frees8(&compact_file);
+	frees8(&dbfile);
+	rmdir((char*)compactdir.s);
+    }
+    rmdir((char*)builddir.s);
+    frees8(&compactdir);
+
+    if (changed)
+    {
+	s8 pcmcache_file = build_pcmcache_path(database_path);
+	remove((char*)pcmcache_file.s);
+	frees8(&pcmcache_file);
+    }
 }
 
 /**
- * jppron:
- * @word: word to be pronounced
- * @audiopth: (optional): Path to the ajt-style audio file directories
+ * jppron_create:
+ * @audio_dir_path: Path to the ajt-style audio file directories
+ * @database_path: The database directory
  *
+ * Indexes all sources into a new database, which then replaces the one at
+ * @database_path without interrupting its readers.
  */
 void
-jppron(char* word, char* reading, char* audiopth)
+jppron_create(char* audio_dir_path, s8 database_path)
 {
-    s8 dbpth = build_database_path();
+    if (create_dir((char*)database_path.s))
+	fatal_perror("Creating directory");
 
-    s8 dbfile = buildpath(dbpth, s8("data.mdb"));
-    int no_access = access((char*)dbfile.s, R_OK);
-    frees8(&dbfile);
+    char** sources = list_sources(audio_dir_path);
+    size nsources = buf_size(sources);
 
-    if (no_access)
+    s8 builddir = new_build_dir(database_path);
+    opendb((char*)builddir.s, DB_CREATE);
+
+    GAsyncQueue* finished = g_async_queue_new();
+    GThreadPool* pool = new_index_pool(finished, nsources);
+    for (size i = 0; i < nsources; i++)
+	g_thread_pool_push(pool, new_batch(audio_dir_path, sources[i], i), NULL);
+
+    // Every source has to be sorted before the merged result can be appended
+    indexbatch** done = new(indexbatch*, nsources + 1);
+    for (size received = 0; received < nsources; received++)
     {
-	if (audiopth)
-	{
-	    msg("Indexing files..");
-	    jppron_create(audiopth, dbpth); // TODO: エラー処理
-	    msg("Index completed.");
-	}
-	else
-	{
-	    debug_msg("No (readable) database file and no audio path provided. Exiting..");
-	    return;
-	}
+	indexbatch* b = g_async_queue_pop(finished);
+	done[b->order] = b;
     }
+    write_batches(done, nsources);
+    for (size i = 0; i < nsources; i++)
+	free_batch(done[i]);
+    free(done);
 
-    play_word(word, reading, dbpth);
+    g_thread_pool_free(pool, FALSE, TRUE);
+    g_async_queue_unref(finished);
+    free_sources(sources);
 
-    frees8(&dbpth);
+    finish_write(database_path, builddir, true, true);
+    frees8(&builddir);
 }
 
-#ifdef INCLUDE_MAIN
-int
-main(int argc, char** argv)
+/*
+ * Returns: true if the index file of @b has the contents recorded in @old,
+ *          although it has been modified
+ */
+static bool
+same_contents(indexbatch* b, sourcemeta old)
 {
-    if (argc < 2)
-	fatal("Usage: %s word", argc > 0 ? argv[0] : "jppron");
+    if (!b->meta.mtime || b->meta.size != old.size)
+	return false;
 
-    char* default_audio_path = g_build_filename(g_get_user_data_dir(), "ajt_japanese_audio", NULL);
+    s8 index_path = buildpath(b->curdir, s8("index.json"));
+    size_t len = 0;
+    char* map = map_file((char*)index_path.s, &len);
+    frees8(&index_path);
+    if (!map)
+	return false;
 
-    if (strcmp(argv[1], "-c") == 0)
-	jppron_create(default_audio_path, build_database_path());
-    else
-	jppron(argv[1], argc > 2 ? argv[2] : 0, default_audio_path);
+    bool same = hash_bytes(map, len) == old.hash;
+    unmap_file(map, len);
+    return same;
+}
+
+/*
+ * Returns: false if the database at @database_path has metadata for exactly
+ *          @sources and none of their index.json files has a new mtime or
+ *          size, which is checked without copying the database
+ */
+static bool
+sources_changed(char* audio_dir_path, s8 database_path, char** sources)
+{
+    s8* dirs = 0;
+    sourcemeta* metas = 0;
+    size nknown = readsourcemetas((char*)database_path.s, &dirs, &metas);
+    size nsources = buf_size(sources);
+
+    bool changed = nknown != nsources;
+    for (size i = 0; i < nsources && !changed; i++)
+    {
+	indexbatch* b = new_batch(audio_dir_path, sources[i], 0);
+	changed = true;
+	for (size k = 0; k < nknown; k++)
+	{
+	    if (s8equals(dirs[k], b->dirname))
+	    {
+		changed = metas[k].mtime != b->meta.mtime || metas[k].size != b->meta.size;
+		break;
+	    }
+	}
+	free_batch(b);
+    }
+
+    frees8buffer(dirs);
+    buf_free(metas);
+    return changed;
+}
+
+/**
+ * jppron_refresh:
+ * @audio_dir_path: Path to the ajt-style audio file directories
+ * @database_path: The database directory
+ *
+ * Re-indexes the sources whose index file changed since they were last
+ * indexed, adds new ones and removes those that are gone. If there are
+ * any, the changes are made to a copy of the database, which then replaces
+ * it like in jppron_create().
+ */
+void
+jppron_refresh(char* audio_dir_path, s8 database_path)
+{
+    char** sources = list_sources(audio_dir_path);
+    size nsources = buf_size(sources);
+
+    if (!sources_changed(audio_dir_path, database_path, sources))
+    {
+	free_sources(sources);
+	msg("Refreshed the index: 0 changed and 0 removed of %td sources.", nsources);
+	return;
+    }
+
+    // Changes are made to a copy, which replaces the database at the end
+    s8 builddir = new_build_dir(database_path);
+    copydb((char*)database_path.s, (char*)builddir.s);
+    opendb((char*)builddir.s, DB_UPDATE);
+
+    s8* known = getmetadirs();
+    if (!known)
+    {
+	finish_write(database_path, builddir, false, false);
+	frees8(&builddir);
+	free_sources(sources);
+	msg("The database has no source metadata yet. Recreating it..");
+	jppron_create(audio_dir_path, database_path);
+	return;
+    }
+
+    // Ids stay the same, so unchanged sources keep their records
+    bool used[MAX_SOURCES] = { 0 };
+    for (size_t i = 0; i < buf_size(known); i++)
+    {
+	sourcemeta m;
+	if (getsourcemeta(known[i], &m))
+	    used[m.id] = true;
+    }
+
+    GAsyncQueue* finished = g_async_queue_new();
+    GThreadPool* pool = new_index_pool(finished, nsources);
+    size nchanged = 0;
+    size ntouched = 0; // Sources with only a new mtime
+    u8* stale = 0;     // Ids of the sources whose records are replaced or removed
+    for (size i = 0; i < nsources; i++)
+    {
+	indexbatch* b = new_batch(audio_dir_path, sources[i], 0);
+	sourcemeta old;
+	bool exists = getsourcemeta(b->dirname, &old);
+	if (exists && old.mtime == b->meta.mtime && old.size == b->meta.size)
+	{
+	    free_batch(b);
+	    continue;
+	}
+	if (exists && same_contents(b, old))
+	{
+	    old.mtime = b->meta.mtime;
+	    putsourcemeta(b->dirname, old);
+	    free_batch(b);
+	    ntouched++;
+	    continue;
+	}
+
+	if (exists)
+	{
+	    b->order = old.id;
+	    buf_push(stale, old.id);
+	}
+	else
+	{
+	    while (b->order < MAX_SOURCES && used[b->order])
+		b->order++;
+	    if (b->order == MAX_SOURCES)
+		fatal("Too many audio sources. At most %d are supported.", MAX_SOURCES);
+	    used[b->order] = true;
+	}
+	b->meta.id = (u8)b->order;
+
+	debug_msg("Source changed: %s", sources[i]);
+	g_thread_pool_push(pool, b, NULL);
+	nchanged++;
+    }
+
+    size nremoved = 0;
+    for (size_t i = 0; i < buf_size(known); i++)
+    {
+	bool present = false;
+	for (size k = 0; k < nsources && !present; k++)
+	    present = s8equals(known[i], fromcstr_(sources[k]));
+
+	sourcemeta m;
+	if (!present && getsourcemeta(known[i], &m))
+	{
+	    debug_msg("Source removed: %.*s", (int)known[i].len, (char*)known[i].s);
+	    buf_push(stale, m.id);
+	    delsourcemeta(known[i]);
+	    nremoved++;
+	}
+    }
+
+    // While the changed sources are parsed
+    deletesources(stale, buf_size(stale));
+    buf_free(stale);
+
+    for (size received = 0; received < nchanged; received++)
+    {
+	indexbatch* b = g_async_queue_pop(finished);
+	replace_source(b);
+	free_batch(b);
+    }
+
+    g_thread_pool_free(pool, FALSE, TRUE);
+    g_async_queue_unref(finished);
+    frees8buffer(known);
+    free_sources(sources);
+
+    finish_write(database_path, builddir, nchanged || nremoved || ntouched, nchanged || nremoved);
+    frees8(&builddir);
+    msg("Refreshed the index: %td changed and %td removed of %td sources.", nchanged, nremoved, nsources);
+}
+
+static fileinfo
+decode_fileinfo(s8 d)
+{
+    if (!d.s)
+	return (fileinfo){ .pitch = -1 };
+    if (d.len < FILEINFO_HEADER_LEN || d.s[0] != FILEINFO_VERSION)
+    {
+	error_msg("Unsupported record format. Please recreate the database with 'jppron -c'.");
+	return (fileinfo){ .pitch = -1 };
+    }
+
+    fileinfo fi = {
+	.origin = getsource(d.s[1]).name,
+	.pitch = d.s[2] == PITCH_UNKNOWN ? -1 : d.s[2],
+    };
+    d.s += FILEINFO_HEADER_LEN;
+    d.len -= FILEINFO_HEADER_LEN;
+    fi.hira_reading = get_field(&d);
+    fi.pitch_number = get_field(&d);
+    fi.pitch_pattern = get_field(&d);
+    return fi;
+}
+
+/*
+ * Returns: The fileinfo of @fn, pointing into the database. Only valid
+ *          until the end of the current lookup.
+ */
+static fileinfo
+getfileinfo(s8 fn)
+{
+    STATS_START(start);
+    fileinfo fi = decode_fileinfo(getfromdb2(fn));
+    STATS_STOP(STAT_RECORD_DECODE, start);
+    return fi;
+}
+
+/*
+ * Plays @files one after another, printing the info of each as it starts.
+ * The files are decoded ahead in the background and written to the sink
+ * without a pause in between.
+ */
+static void
+play_files(s8 audiodir, s8* files)
+{
+    size n = (size)buf_size(files);
+    s8* paths = new(s8, n);
+    for (size i = 0; i < n; i++)
+	paths[i] = build_audio_path(audiodir, files[i]);
+
+    if (audio_get_backend() == AUDIO_FFPLAY)
+    {
+	for (size i = 0; i < n; i++)
+	{
+	    print_fileinfo(getfileinfo(files[i]));
+	    play_audio(paths[i].len, (char*)paths[i].s);
+	}
+    }
+    else
+    {
+	char** cpaths = new(char*, n);
+	for (size i = 0; i < n; i++)
+	    cpaths[i] = (char*)paths[i].s;
+	audio_prefetch* pf = audio_prefetch_start(cpaths, files, n);
+	free(cpaths);
+
+	for (size i = 0; i < n; i++)
+	{
+	    print_fileinfo(getfileinfo(files[i]));
+	    fflush(stdout);
+
+	    pcm p = audio_prefetch_next(pf);
+	    audio_write(p);
+	    pcm_free(&p);
+	}
+	audio_drain();
+	audio_prefetch_free(pf);
+    }
+
+    for (size i = 0; i < n; i++)
+	frees8(&paths[i]);
+    free(paths);
+}
+
+typedef struct {
+    s8 key;
+    i32 idx; // Index into the deinflections
+} probe;
+
+static int
+cmpprobe(const void* a, const void* b)
+{
+    return dbcmp(((const probe*)a)->key, ((const probe*)b)->key);
+}
+
+/*
+ * Probes all deinflections of @word in a single lookup session. Words longer
+ * than MAX_DEINFLECT_LEN bytes are not deinflected, which keeps all
+ * candidates of a word within an arena of 64 KiB.
+ *
+ * Returns: The deinflection with the fewest rules applied that has files,
+ *          allocated from @a, or an empty string if there is none
+ */
+static s8
+find_deinflected(s8 word, arena* a)
+{
+    if (word.len > MAX_DEINFLECT_LEN)
+	return (s8){ 0 };
+    deinflections d = deinflect(word, a);
+
+    // Without @word itself and empty candidates, e.g. of しまう
+    probe* probes = tryanew(a, probe, d.len);
+    s8* keys = tryanew(a, s8, d.len);
+    bool* found = tryanew(a, bool, d.len);
+    if (!probes || !keys || !found)
+	return (s8){ 0 };
+    size n = 0;
+    for (size i = 1; i < d.len; i++)
+    {
+	if (d.items[i].word.len)
+	    probes[n++] = (probe){ .key = d.items[i].word, .idx = (i32)i };
+    }
+    if (n == 0)
+	return (s8){ 0 };
+
+    // In key order the cursor only ever moves forward
+    qsort(probes, (size_t)n, sizeof(*probes), cmpprobe);
+
+    for (size i = 0; i < n; i++)
+	keys[i] = probes[i].key;
+    haskeys(keys, n, found);
+
+    // Deinflections are in breadth-first order, so the lowest index has the
+    // fewest rules applied
+    i32 best = -1;
+    for (size i = 0; i < n; i++)
+    {
+	if (found[i] && (best == -1 || probes[i].idx < best))
+	    best = probes[i].idx;
+    }
+    return best == -1 ? (s8){ 0 } : d.items[best].word;
+}
+
+/*
+ * Expects the database to be opened read-only.
+ */
+static void
+play_word(char* word, char* reading, s8 audiodir)
+{
+    // The arguments are writable
+    s8 hira_reading = fromcstr_(reading);
+    STATS_START(start);
+    kata2hira_inplace(hira_reading);
+    STATS_STOP(STAT_KATA2HIRA, start);
+
+    beginlookup();
+    s8 headword = fromcstr_(word);
+    s8* files = getfiles(headword);
+    s8 guessed = { 0 };
+    s8* selected = 0;
+
+    u8 mem[1 << 16];
+    if (!files)
+    {
+	arena scratch = { .beg = mem, .end = mem + countof(mem) };
+	headword = find_deinflected(headword, &scratch);
+	if (headword.len)
+	{
+	    msg("Nothing found for %s. Using %.*s instead.", word, (int)headword.len, (char*)headword.s);
+	    files = getfiles(headword);
+	}
+    }
+
+    if (!files)
+    {
+	msg("Nothing found.");
+	goto cleanup;
+    }
+
+    if (!reading && buf_size(files) > 1)
+    {
+	// Only a hint, which narrows down the files if any of them matches
+	guessed = kanji2hira(headword);
+	hira_reading = guessed;
+    }
+
+    if (hira_reading.len)
+	selected = getfilesbyreading(headword, hira_reading);
+    if (reading && !selected)
+	msg("Could not find an audio file with corresponding reading. Playing all..");
+
+    play_files(audiodir, selected ? selected : files);
+
+cleanup:
+    frees8(&guessed);
+    buf_free(selected);
+    buf_free(files);
+    endlookup();
+}
+
+static s8
+build_database_path()
+{
+    return fromcstr_(g_build_filename(g_get_user_data_dir(), "jppron", NULL));
+}
+
+static void
+open_pcmcache(s8 dbpth)
+{
+    s8 path = build_pcmcache_path(dbpth);
+    pcmcache_open((char*)path.s);
+    frees8(&path);
+}
+
+/*
+ * Creates the database at @dbpth from @audiopth if there is none yet.
+ *
+ * Returns: true if there is a database to read from
+ */
+static bool
+ensure_database(s8 dbpth, char* audiopth)
+{
+    s8 dbfile = buildpath(dbpth, s8("data.mdb"));
+    int no_access = access((char*)dbfile.s, R_OK);
+    frees8(&dbfile);
+
+    if (no_access)
+    {
+	if (audiopth)
+	{
+	    msg("Indexing files..");
+	    jppron_create(audiopth, dbpth); // TODO: エラー処理
+	    msg("Index completed.");
+	}
+	else
+	{
+	    debug_msg("No (readable) database file and no audio path provided. Exiting..");
+	    return false;
+	}
+    }
+    return true;
+}
+
+/**
+ * jppron:
+ * @word: word to be pronounced
+ * @audiopth: Path to the ajt-style audio file directories
+ *
+ */
+void
+jppron(char* word, char* reading, char* audiopth)
+{
+    s8 dbpth = build_database_path();
+
+    if (ensure_database(dbpth, audiopth))
+    {
+	opendb((char*)dbpth.s, DB_READONLY);
+	// Indexing the cache file would cost more than it saves on one word
+	pcmcache_open(NULL);
+	play_word(word, reading, fromcstr_(audiopth));
+	pcmcache_close();
+	closedb();
+	audio_close();
+    }
+
+    frees8(&dbpth);
+}
+
+static void
+print_json_string(s8 str)
+{
+    putchar('"');
+    for (size i = 0; i < str.len; i++)
+    {
+	u8 c = str.s[i];
+	if (c == '"' || c == '\\')
+	    printf("\\%c", c);
+	else if (c < 0x20)
+	    printf("\\u%04x", c);
+	else
+	    putchar(c);
+    }
+    putchar('"');
+}
+
+static void
+print_batch_json(s8 word, s8 reading, s8 headword, readingentry* entries, s8 audiodir)
+{
+    fputs("{\"word\":", stdout);
+    print_json_string(word);
+    fputs(",\"reading\":", stdout);
+    if (reading.len)
+	print_json_string(reading);
+    else
+	fputs("null", stdout);
+    fputs(",\"headword\":", stdout);
+    if (entries && headword.len)
+	print_json_string(headword);
+    else
+	fputs("null", stdout);
+    fputs(",\"results\":[", stdout);
+
+    for (size_t i = 0; i < buf_size(entries); i++)
+    {
+	fileinfo fi = getfileinfo(entries[i].fileref);
+	s8 path = build_audio_path(audiodir, entries[i].fileref);
+	fputs(i == 0 ? "{\"path\":" : ",{\"path\":", stdout);
+	print_json_string(path);
+	fputs(",\"headword\":", stdout);
+	print_json_string(entries[i].headword);
+	fputs(",\"source\":", stdout);
+	print_json_string(fi.origin);
+	fputs(",\"reading\":", stdout);
+	print_json_string(fi.hira_reading);
+	fputs(",\"pitch_number\":", stdout);
+	print_json_string(fi.pitch_number);
+	fputs(",\"pitch_pattern\":", stdout);
+	print_json_string(fi.pitch_pattern);
+	if (fi.pitch >= 0)
+	    printf(",\"pitch\":%d}", (int)fi.pitch);
+	else
+	    fputs(",\"pitch\":null}", stdout);
+	frees8(&path);
+    }
+    fputs("]}\n", stdout);
+}
+
+static void
+print_batch_tsv(s8 word, s8 reading, readingentry* entries, s8 audiodir)
+{
+    for (size_t i = 0; i < buf_size(entries); i++)
+    {
+	fileinfo fi = getfileinfo(entries[i].fileref);
+	s8 path = build_audio_path(audiodir, entries[i].fileref);
+	printf("%.*s\t%.*s\t%.*s\t%.*s\t%.*s\t%.*s\t%.*s\t%.*s\n",
+	       (int)word.len, (char*)word.s,
+	       (int)reading.len, (char*)reading.s,
+	       (int)path.len, (char*)path.s,
+	       (int)fi.origin.len, (char*)fi.origin.s,
+	       (int)fi.hira_reading.len, (char*)fi.hira_reading.s,
+	       (int)fi.pitch_number.len, (char*)fi.pitch_number.s,
+	       (int)fi.pitch_pattern.len, (char*)fi.pitch_pattern.s,
+	       (int)entries[i].headword.len, (char*)entries[i].headword.s);
+	frees8(&path);
+    }
+    if (!entries)
+	printf("%.*s\t%.*s\t\t\t\t\t\t\n",
+	       (int)word.len, (char*)word.s,
+	       (int)reading.len, (char*)reading.s);
+}
+
+/**
+ * jppron_batch:
+ * @audiopth: Path to the ajt-style audio file directories
+ * @json: Print a JSON object per line instead of tab-separated values
+ *
+ * Looks up every "word[\treading]" line of stdin without playing anything.
+ * Words without files are deinflected, see find_deinflected(). A line with
+ * an empty word looks up every headword with the reading.
+ * The tab-separated output has a row per file with the columns word, reading,
+ * path, source, reading of the file, pitch number, pitch pattern and the
+ * headword that was found. Words without files get a row with the last six
+ * columns empty.
+ */
+void
+jppron_batch(char* audiopth, bool json)
+{
+    s8 dbpth = build_database_path();
+    if (!ensure_database(dbpth, audiopth))
+    {
+	frees8(&dbpth);
+	return;
+    }
+    opendb((char*)dbpth.s, DB_READONLY);
+    s8 audiodir = fromcstr_(audiopth);
+
+    // All lines are resolved against the same snapshot
+    beginlookup();
+
+    u8* mem = xmalloc(1 << 16);
+    arena scratch = { .beg = mem, .end = mem + (1 << 16) };
+
+    char* line = 0;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, stdin)) != -1)
+    {
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+	    line[--len] = '\0';
+	if (len == 0)
+	    continue;
+
+	s8 word = { .s = (u8*)line, .len = len };
+	s8 reading = { 0 };
+	char* tab = memchr(line, '\t', (size_t)len);
+	if (tab)
+	{
+	    *tab = '\0';
+	    word.len = (u8*)tab - word.s;
+	    reading = fromcstr_(tab + 1);
+	}
+
+	scratch.beg = mem;
+	s8 hira_reading = reading;
+	if (has_katakana(reading))
+	{
+	    // @reading is printed as given. One too long for the arena cannot
+	    // be a key of the index anyway.
+	    hira_reading.s = tryanew(&scratch, u8, reading.len);
+	    if (hira_reading.s)
+	    {
+		memcpy(hira_reading.s, reading.s, (size_t)reading.len);
+		STATS_START(start);
+		kata2hira_inplace(hira_reading);
+		STATS_STOP(STAT_KATA2HIRA, start);
+	    }
+	    else
+		hira_reading = reading;
+	}
+
+	if (!word.len)
+	{
+	    readingentry* entries = hira_reading.len ? getreadingentries(hira_reading) : 0;
+	    if (json)
+		print_batch_json(word, reading, (s8){ 0 }, entries, audiodir);
+	    else
+		print_batch_tsv(word, reading, entries, audiodir);
+	    buf_free(entries);
+	    continue;
+	}
+
+	s8 headword = word;
+	s8* files = getfiles(word);
+	if (!files)
+	{
+	    headword = find_deinflected(word, &scratch);
+	    if (headword.len)
+		files = getfiles(headword);
+	}
+	s8 guessed = { 0 };
+	if (!reading.len && buf_size(files) > 1)
+	{
+	    guessed = kanji2hira(headword); // See play_word()
+	    hira_reading = guessed;
+	}
+	s8* selected = hira_reading.len && files ? getfilesbyreading(headword, hira_reading) : 0;
+	s8* shown = selected ? selected : files;
+
+	readingentry* entries = 0;
+	for (size_t i = 0; i < buf_size(shown); i++)
+	    buf_push(entries, ((readingentry){ headword, shown[i] }));
+
+	if (json)
+	    print_batch_json(word, reading, headword, entries, audiodir);
+	else
+	    print_batch_tsv(word, reading, entries, audiodir);
+
+	frees8(&guessed);
+	buf_free(entries);
+	buf_free(selected);
+	buf_free(files);
+    }
+
+    endlookup();
+    free(mem);
+    free(line);
+    closedb();
+    frees8(&dbpth);
+}
+
+static bool
+print_pitch_entry(pitchentry e, void* user_data)
+{
+    s8 audiodir = *(s8*)user_data;
+    fileinfo fi = getfileinfo(e.fileref);
+    s8 path = build_audio_path(audiodir, e.fileref);
+    printf("%.*s\t%.*s\t%d\t%.*s\t%.*s\t%.*s\t%.*s\n",
+	   (int)e.headword.len, (char*)e.headword.s,
+	   (int)e.reading.len, (char*)e.reading.s,
+	   (int)e.morae,
+	   (int)fi.pitch_number.len, (char*)fi.pitch_number.s,
+	   (int)fi.pitch_pattern.len, (char*)fi.pitch_pattern.s,
+	   (int)fi.origin.len, (char*)fi.origin.s,
+	   (int)path.len, (char*)path.s);
+    frees8(&path);
+    return true;
+}
+
+/*
+ * Returns: false if @arg is not a decimal number between 0 and @max
+ */
+static bool
+parse_number(const char* arg, long max, long* out)
+{
+    char* end;
+    long n = strtol(arg, &end, 10);
+    if (end == arg || *end || n < 0 || n > max)
+	return false;
+    *out = n;
+    return true;
+}
+
+/*
+ * Parses the arguments "pitch [morae]" of --pitch from @argv.
+ *
+ * Returns: false if they are invalid
+ */
+static bool
+parse_pitch_query(int argc, char** argv, u8* pitch, i32* morae)
+{
+    long p, m = -1;
+    if (argc < 1 || !parse_number(argv[0], PITCH_UNKNOWN - 1, &p)
+	|| (argc > 1 && !parse_number(argv[1], 0xFF, &m)))
+	return false;
+
+    *pitch = (u8)p;
+    *morae = (i32)m;
+    return true;
+}
+
+/*
+ * Prints a tab-separated row with the headword, reading, number of morae,
+ * pitch number, pitch pattern, source and path of every file with the
+ * downstep after mora @pitch (0 for heiban) and @morae morae, or any number
+ * if negative. Rows are printed as the index is walked.
+ *
+ * Expects the database to be opened read-only.
+ */
+static void
+print_pitch_query(s8 audiodir, u8 pitch, i32 morae)
+{
+    beginlookup();
+    getpitchentries(pitch, morae, print_pitch_entry, &audiodir);
+    endlookup();
+    fflush(stdout);
+}
+
+/**
+ * jppron_pitch:
+ * @audiopth: Path to the ajt-style audio file directories
+ * @pitch: The pitch number
+ * @morae: The number of morae, or -1 for any
+ *
+ * Lists all files with the given pitch accent, see print_pitch_query().
+ */
+void
+jppron_pitch(char* audiopth, u8 pitch, i32 morae)
+{
+    s8 dbpth = build_database_path();
+
+    if (ensure_database(dbpth, audiopth))
+    {
+	opendb((char*)dbpth.s, DB_READONLY);
+	print_pitch_query(fromcstr_(audiopth), pitch, morae);
+	closedb();
+    }
+
+    frees8(&dbpth);
+}
+
+static bool
+print_headword(s8 headword, void* user_data)
+{
+    printf("%.*s\n", (int)headword.len, (char*)headword.s);
+    return true;
+}
+
+/*
+ * Parses the arguments "prefix [limit [offset]]" of --prefix from @argv.
+ *
+ * Returns: false if they are invalid
+ */
+static bool
+parse_prefix_query(int argc, char** argv, s8* prefix, size* limit, size* offset)
+{
+    long l = 0, o = 0;
+    if (argc < 1 || (argc > 1 && !parse_number(argv[1], LONG_MAX, &l))
+	|| (argc > 2 && !parse_number(argv[2], LONG_MAX, &o)))
+	return false;
+
+    *prefix = fromcstr_(argv[0]);
+    *limit = (size)l;
+    *offset = (size)o;
+    return true;
+}
+
+/*
+ * Prints the headwords starting with @prefix, one per line, see
+ * getheadwords(). Expects the database to be opened read-only.
+ */
+static void
+print_prefix_query(s8 prefix, size limit, size offset)
+{
+    beginlookup();
+    getheadwords(prefix, offset, limit, print_headword, NULL);
+    endlookup();
+    fflush(stdout);
+}
+
+/**
+ * jppron_prefix:
+ * @audiopth: Path to the ajt-style audio file directories
+ * @prefix: The beginning of the headwords
+ * @limit: The maximum number of headwords to print, 0 for all
+ * @offset: The number of headwords to skip
+ *
+ * Lists the headwords starting with @prefix, e.g. for completion.
+ */
+void
+jppron_prefix(char* audiopth, s8 prefix, size limit, size offset)
+{
+    s8 dbpth = build_database_path();
+
+    if (ensure_database(dbpth, audiopth))
+    {
+	opendb((char*)dbpth.s, DB_READONLY);
+	print_prefix_query(prefix, limit, offset);
+	closedb();
+    }
+
+    frees8(&dbpth);
+}
+
+typedef struct {
+    s8 dbpth;
+    char* audiopth;
+} daemon_state;
+
+/*
+ * Switches to the new database if it has been rebuilt since it was opened
+ */
+static void
+reopen_if_replaced(daemon_state* state)
+{
+    if (!dbreplaced())
+	return;
+
+    debug_msg("The database has been rebuilt. Reopening it..");
+    pcmcache_close();
+    closedb();
+    opendb((char*)state->dbpth.s, DB_READONLY);
+    open_pcmcache(state->dbpth);
+}
+
+/*
+ * Builds or refreshes the database from within the daemon, whose own
+ * read-only handles share the globals of database.c with the writer and
+ * have to be closed for it.
+ */
+static void
+rebuild(daemon_state* state, bool refresh)
+{
+    pcmcache_close();
+    closedb();
+
+    if (refresh)
+	jppron_refresh(state->audiopth, state->dbpth);
+    else
+	jppron_create(state->audiopth, state->dbpth);
+
+    opendb((char*)state->dbpth.s, DB_READONLY);
+    open_pcmcache(state->dbpth);
+}
+
+/*
+ * Returns: false for the modes --stats cannot wrap, which keep running and
+ *          never return to print their stats
+ */
+static bool
+times_request(const char* arg)
+{
+    return strcmp(arg, "--batch") != 0 && strcmp(arg, "--daemon") != 0;
+}
+
+/*
+ * Handles the arguments of a client like main() would, but with the
+ * database kept open.
+ */
+static int
+serve_request(int argc, char** argv, void* user_data)
+{
+    daemon_state* state = user_data;
+
+    reopen_if_replaced(state);
+
+    if (strcmp(argv[0], "-c") == 0)
+	rebuild(state, false);
+    else if (strcmp(argv[0], "--refresh") == 0)
+	rebuild(state, true);
+    else if (strcmp(argv[0], "--cache-stats") == 0)
+	pcmcache_print_stats();
+    else if (strcmp(argv[0], "--stats") == 0)
+    {
+	// Without a request, what was recorded since the daemon started
+	bool json = argc > 1 && strcmp(argv[1], "--json") == 0;
+	int skip = json ? 2 : 1;
+	if (argc > skip && !times_request(argv[skip]))
+	{
+	    error_msg("--stats cannot time %s.", argv[skip]);
+	    return EXIT_FAILURE;
+	}
+	else if (argc > skip)
+	{
+	    stats_snapshot before = stats_get();
+	    int status = serve_request(argc - skip, argv + skip, user_data);
+	    stats_print(&before, json);
+	    return status;
+	}
+	else
+	    stats_print(0, json);
+    }
+    else if (strcmp(argv[0], "--pitch") == 0)
+    {
+	u8 pitch;
+	i32 morae;
+	if (parse_pitch_query(argc - 1, argv + 1, &pitch, &morae))
+	    print_pitch_query(fromcstr_(state->audiopth), pitch, morae);
+	else
+	{
+	    error_msg("Usage: --pitch pitch [morae], where pitch is the number of a downstep. Pitch patterns cannot be queried.");
+	    return EXIT_FAILURE;
+	}
+    }
+    else if (strcmp(argv[0], "--prefix") == 0)
+    {
+	s8 prefix;
+	size limit, offset;
+	if (parse_prefix_query(argc - 1, argv + 1, &prefix, &limit, &offset))
+	    print_prefix_query(prefix, limit, offset);
+	else
+	{
+	    error_msg("Usage: --prefix prefix [limit [offset]]");
+	    return EXIT_FAILURE;
+	}
+    }
+    else
+	play_word(argv[0], argc > 1 ? argv[1] : 0, fromcstr_(state->audiopth));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * jppron_daemon:
+ * @audiopth: Path to the ajt-style audio file directories
+ *
+ * Serves requests of jppron clients over a Unix socket until an error occurs.
+ */
+void
+jppron_daemon(char* audiopth)
+{
+    daemon_state state = { .dbpth = build_database_path(), .audiopth = audiopth };
+
+    if (ensure_database(state.dbpth, audiopth))
+    {
+	opendb((char*)state.dbpth.s, DB_READONLY);
+	open_pcmcache(state.dbpth);
+	s8 sockpath = daemon_socket_path();
+	daemon_serve((char*)sockpath.s, serve_request, &state);
+	frees8(&sockpath);
+	pcmcache_close();
+	closedb();
+	audio_close();
+    }
+
+    frees8(&state.dbpth);
+}
+
+#ifdef INCLUDE_MAIN
+int
+main(int argc, char** argv)
+{
+    if (argc < 2)
+	fatal("Usage: %s [--daemon | --batch [--json] | -c | --refresh | --cache-stats | --stats [--json] [args] | --pitch pitch [morae] | --prefix prefix [limit [offset]] | word [reading]]", argc > 0 ? argv[0] : "jppron");
+
+    char* default_audio_path = g_build_filename(g_get_user_data_dir(), "ajt_japanese_audio", NULL);
+
+    if (strcmp(argv[1], "--daemon") == 0)
+    {
+	jppron_daemon(default_audio_path);
+	return EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "--batch") == 0)
+    {
+	// Not forwarded, since the daemon cannot read our stdin
+	jppron_batch(default_audio_path, argc > 2 && strcmp(argv[2], "--json") == 0);
+	return EXIT_SUCCESS;
+    }
+
+    // Let a running daemon handle the request if there is one
+    s8 sockpath = daemon_socket_path();
+    int status;
+    bool forwarded = daemon_forward((char*)sockpath.s, argc - 1, argv + 1, &status);
+    frees8(&sockpath);
+    if (forwarded)
+	return status;
+
+    // Runs the remaining arguments and prints where their time went
+    bool stats = strcmp(argv[1], "--stats") == 0;
+    bool stats_json = stats && argc > 2 && strcmp(argv[2], "--json") == 0;
+    if (stats)
+    {
+	int skip = stats_json ? 2 : 1;
+	if (argc - skip < 2)
+	{
+	    msg("Stats of past requests live in the daemon, which is not running.");
+	    return EXIT_SUCCESS;
+	}
+	if (!times_request(argv[skip + 1]))
+	    fatal("--stats cannot time %s.", argv[skip + 1]);
+	argv[skip] = argv[0];
+	argc -= skip;
+	argv += skip;
+    }
+
+    if (strcmp(argv[1], "-c") == 0)
+	jppron_create(default_audio_path, build_database_path());
+    else if (strcmp(argv[1], "--refresh") == 0)
+    {
+	s8 dbpth = build_database_path();
+	if (ensure_database(dbpth, default_audio_path))
+	    jppron_refresh(default_audio_path, dbpth);
+	frees8(&dbpth);
+    }
+    else if (strcmp(argv[1], "--cache-stats") == 0)
+	msg("The audio cache lives in the daemon, which is not running.");
+    else if (strcmp(argv[1], "--pitch") == 0)
+    {
+	u8 pitch;
+	i32 morae;
+	if (!parse_pitch_query(argc - 2, argv + 2, &pitch, &morae))
+	    fatal("Usage: %s --pitch pitch [morae], where pitch is the number of a downstep. Pitch patterns cannot be queried.", argv[0]);
+	jppron_pitch(default_audio_path, pitch, morae);
+    }
+    else if (strcmp(argv[1], "--prefix") == 0)
+    {
+	s8 prefix;
+	size limit, offset;
+	if (!parse_prefix_query(argc - 2, argv + 2, &prefix, &limit, &offset))
+	    fatal("Usage: %s --prefix prefix [limit [offset]]", argv[0]);
+	jppron_prefix(default_audio_path, prefix, limit, offset);
+    }
+    else
+	jppron(argv[1], argc > 2 ? argv[2] : 0, default_audio_path);
+
+    if (stats)
+	stats_print(0, stats_json);
 }
 #endif
@@ -0,0 +1,420 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h> // flock
+
+#include <glib.h>
+
+#include "util.h"
+#include "audio.h"
+#include "platformdep.h"
+#include "pcmcache.h"
+
+#define DEFAULT_CACHE_MB 64
+#define DISK_MAGIC "JPPCM\0\0\1"
+
+/*
+ * The cache file is a header followed by entries, each of which is a
+ * disk_entry, the key and the samples. Everything is 8-byte aligned.
+ */
+typedef struct {
+    char magic[8];
+    u32 rate;
+    u32 channels;
+} disk_header;
+
+typedef struct {
+    u32 keylen;
+    u32 frames;
+} disk_entry;
+
+/* An entry of the LRU list in memory */
+typedef struct mem_entry {
+    s8 key; // Key in the hash table
+    pcm p;
+    struct mem_entry* prev; // More recently used, NULL for the most recent
+    struct mem_entry* next; // Less recently used, NULL for the least recent
+} mem_entry;
+
+/* An entry of the cache file */
+typedef struct {
+    s8 key;             // Key in the hash table, points into the mapping
+    const i16* samples; // NULL if appended after the file was mapped
+    size frames;
+} disk_ref;
+
+/* All of it is guarded by @lock */
+static struct {
+    GMutex lock;
+    bool enabled;
+    GHashTable* mem;
+    mem_entry* most_recent;
+    mem_entry* least_recent;
+
+    int fd; // Of the cache file, -1 if the disk cache is disabled
+    char* map;
+    size_t maplen;
+    GHashTable* disk;
+    size max_disk_bytes;
+
+    pcmcache_stats stats;
+} cache = { .fd = -1 };
+
+static size
+align8(size n)
+{
+    return (n + 7) & ~(size)7;
+}
+
+static size
+pcm_bytes(pcm p)
+{
+    return p.frames * AUDIO_CHANNELS * (size)sizeof(*p.samples);
+}
+
+static pcm
+pcm_copy(const i16* samples, size frames)
+{
+    pcm ret = { .samples = xmalloc((size_t)(frames * AUDIO_CHANNELS) * sizeof(*samples)),
+		.frames = frames };
+    memcpy(ret.samples, samples, (size_t)pcm_bytes(ret));
+    return ret;
+}
+
+static guint
+key_hash(gconstpointer key)
+{
+    const s8* k = key;
+    guint h = 2166136261u; // FNV-1a
+    for (size i = 0; i < k->len; i++)
+	h = (h ^ k->s[i]) * 16777619u;
+    return h;
+}
+
+static gboolean
+key_equal(gconstpointer a, gconstpointer b)
+{
+    return s8equals(*(const s8*)a, *(const s8*)b);
+}
+
+/*
+ * Returns: The value of the environment variable @name in bytes, which is
+ *          given in megabytes, or @def megabytes if it is not set
+ */
+static size
+env_megabytes(const char* name, size def)
+{
+    const char* env = getenv(name);
+    if (!env || !*env)
+	return def << 20;
+
+    char* end;
+    long mb = strtol(env, &end, 10);
+    if (*end || mb < 0)
+    {
+	error_msg("Invalid value for %s: '%s'. Using %td..", name, env, def);
+	return def << 20;
+    }
+    return (size)mb << 20;
+}
+
+static void
+mem_unlink(mem_entry* e)
+{
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	cache.most_recent = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	cache.least_recent = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void
+mem_push_front(mem_entry* e)
+{
+    e->next = cache.most_recent;
+    if (cache.most_recent)
+	cache.most_recent->prev = e;
+    cache.most_recent = e;
+    if (!cache.least_recent)
+	cache.least_recent = e;
+}
+
+static void
+mem_entry_free(gpointer data)
+{
+    mem_entry* e = data;
+    cache.stats.entries--;
+    cache.stats.bytes -= e->key.len + pcm_bytes(e->p);
+    frees8(&e->key);
+    pcm_free(&e->p);
+    free(e);
+}
+
+/*
+ * Stores @p in memory, which takes ownership of it.
+ */
+static void
+mem_put(s8 key, pcm p)
+{
+    size bytes = key.len + pcm_bytes(p);
+    if (bytes > cache.stats.max_bytes)
+    {
+	pcm_free(&p);
+	return;
+    }
+
+    while (cache.stats.bytes + bytes > cache.stats.max_bytes)
+    {
+	mem_entry* oldest = cache.least_recent;
+	mem_unlink(oldest);
+	g_hash_table_remove(cache.mem, &oldest->key);
+    }
+
+    mem_entry* e = new(mem_entry, 1);
+    e->key = s8dup(key);
+    e->p = p;
+    g_hash_table_insert(cache.mem, &e->key, e);
+    mem_push_front(e);
+    cache.stats.entries++;
+    cache.stats.bytes += bytes;
+}
+
+/*
+ * Indexes the entries of the mapped cache file.
+ *
+ * Returns: The length of the valid part of the file
+ */
+static size_t
+disk_index(void)
+{
+    size_t off = sizeof(disk_header);
+    while (off + sizeof(disk_entry) <= cache.maplen)
+    {
+	disk_entry de;
+	memcpy(&de, cache.map + off, sizeof(de));
+	size keyoff = (size)(off + sizeof(de));
+	size sampleoff = keyoff + align8(de.keylen);
+	size end = sampleoff + align8((size)de.frames * AUDIO_CHANNELS * (size)sizeof(i16));
+	if (!de.keylen || end > (size)cache.maplen)
+	    break;
+
+	disk_ref* ref = new(disk_ref, 1);
+	*ref = (disk_ref){
+	    .key = { .s = (u8*)cache.map + keyoff, .len = de.keylen },
+	    .samples = (const i16*)(cache.map + sampleoff),
+	    .frames = de.frames,
+	};
+	g_hash_table_replace(cache.disk, &ref->key, ref);
+	cache.stats.disk_entries++;
+	off = (size_t)end;
+    }
+    return off;
+}
+
+static void
+disk_open(const char* path)
+{
+    cache.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (cache.fd == -1)
+    {
+	error_msg("Could not open the audio cache %s: %s", path, strerror(errno));
+	return;
+    }
+    cache.disk = g_hash_table_new_full(key_hash, key_equal, NULL, free);
+
+    disk_header want = { .rate = AUDIO_RATE, .channels = AUDIO_CHANNELS };
+    memcpy(want.magic, DISK_MAGIC, sizeof(want.magic));
+
+    // Appends of other processes hold the lock, so an incomplete entry at
+    // the end is left behind by one that died and not one still writing
+    bool locked = flock(cache.fd, LOCK_EX) == 0;
+    cache.map = map_file(path, &cache.maplen);
+    size_t valid = 0;
+    if (cache.map && cache.maplen >= sizeof(want) && !memcmp(cache.map, &want, sizeof(want)))
+	valid = disk_index();
+
+    // Drops a partially written entry at the end or a file of another format
+    if (locked && (valid < cache.maplen || !valid))
+    {
+	if (ftruncate(cache.fd, (off_t)valid) == -1)
+	    error_msg("Could not truncate the audio cache: %s", strerror(errno));
+	else if (!valid && write(cache.fd, &want, sizeof(want)) != sizeof(want))
+	    error_msg("Could not write the audio cache: %s", strerror(errno));
+    }
+    if (locked)
+	flock(cache.fd, LOCK_UN);
+    else
+	error_msg("Could not lock the audio cache: %s", strerror(errno));
+
+    cache.stats.disk_bytes = valid ? (size)valid : (size)sizeof(want);
+}
+
+static void
+disk_put(s8 key, pcm p)
+{
+    if (cache.fd == -1 || g_hash_table_contains(cache.disk, &key))
+	return;
+
+    size len = (size)sizeof(disk_entry) + align8(key.len) + align8(pcm_bytes(p));
+    if (cache.stats.disk_bytes + len > cache.max_disk_bytes)
+	return;
+
+    u8* entry = xcalloc(1, (size_t)len);
+    disk_entry de = { .keylen = (u32)key.len, .frames = (u32)p.frames };
+    memcpy(entry, &de, sizeof(de));
+    memcpy(entry + sizeof(de), key.s, (size_t)key.len);
+    memcpy(entry + sizeof(de) + align8(key.len), p.samples, (size_t)pcm_bytes(p));
+
+    // Under the lock, so that disk_open() of another process does not take
+    // the entry for an incomplete one while it is written
+    if (flock(cache.fd, LOCK_EX) == -1)
+	error_msg("Could not lock the audio cache: %s", strerror(errno));
+    else if (write(cache.fd, entry, (size_t)len) != len)
+	error_msg("Could not write the audio cache: %s", strerror(errno));
+    else
+    {
+	disk_ref* ref = new(disk_ref, 1);
+	ref->key = s8dup(key); // Not in the mapping
+	g_hash_table_insert(cache.disk, &ref->key, ref);
+	cache.stats.disk_bytes += len;
+    }
+    flock(cache.fd, LOCK_UN);
+    free(entry);
+}
+
+void
+pcmcache_open(const char* diskpath)
+{
+    g_mutex_lock(&cache.lock);
+    if (!cache.enabled)
+    {
+	cache.stats = (pcmcache_stats){ .max_bytes = env_megabytes("JPPRON_CACHE_MB", DEFAULT_CACHE_MB) };
+	cache.mem = g_hash_table_new_full(key_hash, key_equal, NULL, mem_entry_free);
+
+	cache.max_disk_bytes = env_megabytes("JPPRON_DISK_CACHE_MB", 0);
+	if (diskpath && cache.max_disk_bytes)
+	    disk_open(diskpath);
+	cache.enabled = true;
+    }
+    g_mutex_unlock(&cache.lock);
+}
+
+static void
+disk_ref_free_key(gpointer key, gpointer value, gpointer user_data)
+{
+    disk_ref* ref = value;
+    if (!ref->samples)
+	frees8(&ref->key);
+}
+
+void
+pcmcache_close(void)
+{
+    g_mutex_lock(&cache.lock);
+    if (cache.enabled)
+    {
+	g_hash_table_destroy(cache.mem);
+	cache.most_recent = cache.least_recent = NULL;
+
+	if (cache.disk)
+	{
+	    g_hash_table_foreach(cache.disk, disk_ref_free_key, NULL);
+	    g_hash_table_destroy(cache.disk);
+	    cache.disk = NULL;
+	}
+	if (cache.map)
+	    unmap_file(cache.map, cache.maplen);
+	cache.map = NULL;
+	if (cache.fd != -1)
+	    close(cache.fd);
+	cache.fd = -1;
+	cache.enabled = false;
+    }
+    g_mutex_unlock(&cache.lock);
+}
+
+/*
+ * Expects @cache.lock to be held and the cache to be enabled.
+ */
+static bool
+get_locked(s8 key, pcm* out)
+{
+    mem_entry* e = g_hash_table_lookup(cache.mem, &key);
+    if (e)
+    {
+	mem_unlink(e);
+	mem_push_front(e);
+	*out = pcm_copy(e->p.samples, e->p.frames);
+	cache.stats.mem_hits++;
+	return true;
+    }
+
+    disk_ref* ref = cache.disk ? g_hash_table_lookup(cache.disk, &key) : NULL;
+    if (ref && ref->samples)
+    {
+	*out = pcm_copy(ref->samples, ref->frames);
+	mem_put(key, pcm_copy(ref->samples, ref->frames));
+	cache.stats.disk_hits++;
+	return true;
+    }
+
+    cache.stats.misses++;
+    return false;
+}
+
+bool
+pcmcache_get(s8 key, pcm* out)
+{
+    g_mutex_lock(&cache.lock);
+    bool hit = cache.enabled && get_locked(key, out);
+    g_mutex_unlock(&cache.lock);
+    return hit;
+}
+
+void
+pcmcache_put(s8 key, pcm p)
+{
+    if (!p.samples || !key.len)
+	return;
+
+    g_mutex_lock(&cache.lock);
+    if (cache.enabled && !g_hash_table_contains(cache.mem, &key))
+    {
+	mem_put(key, pcm_copy(p.samples, p.frames));
+	disk_put(key, p);
+    }
+    g_mutex_unlock(&cache.lock);
+}
+
+pcmcache_stats
+pcmcache_get_stats(void)
+{
+    g_mutex_lock(&cache.lock);
+    pcmcache_stats ret = cache.stats;
+    g_mutex_unlock(&cache.lock);
+    return ret;
+}
+
+void
+pcmcache_print_stats(void)
+{
+    pcmcache_stats s = pcmcache_get_stats();
+    size lookups = s.mem_hits + s.disk_hits + s.misses;
+    double mib = 1 << 20;
+
+    printf("Audio cache: %td entries, %.1f of %.1f MiB\n", s.entries, (double)s.bytes / mib,
+	   (double)s.max_bytes / mib);
+    printf("Hits: %td in memory, %td on disk, misses: %td (hit rate %.1f%%)\n",
+	   s.mem_hits, s.disk_hits, s.misses,
+	   lookups ? 100.0 * (double)(s.mem_hits + s.disk_hits) / (double)lookups : 0.0);
+    if (s.disk_bytes)
+	printf("Disk cache: %td entries mapped, %.1f MiB\n", s.disk_entries, (double)s.disk_bytes / mib);
+}
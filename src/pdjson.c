@@ -7,6 +7,40 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+
+/* Buffer sources are scanned in blocks where the compiler targets SSE2 or
+ * AVX2. Everything else uses the byte by byte code paths. */
+#if !defined(PDJSON_NO_SIMD) && defined(__GNUC__) && defined(__AVX2__)
+#  include <immintrin.h>
+#  define PDJSON_SIMD_WIDTH 32
+typedef __m256i simd_vec;
+#  define simd_load(p)    _mm256_loadu_si256((const __m256i *)(p))
+#  define simd_set1(c)    _mm256_set1_epi8((char)(c))
+#  define simd_eq(a, b)   _mm256_cmpeq_epi8((a), (b))
+#  define simd_gt(a, b)   _mm256_cmpgt_epi8((a), (b))
+#  define simd_and(a, b)  _mm256_and_si256((a), (b))
+#  define simd_or(a, b)   _mm256_or_si256((a), (b))
+#  define simd_mask(v)    ((uint64_t)(uint32_t)_mm256_movemask_epi8(v))
+#elif !defined(PDJSON_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#  include <emmintrin.h>
+#  define PDJSON_SIMD_WIDTH 16
+typedef __m128i simd_vec;
+#  define simd_load(p)    _mm_loadu_si128((const __m128i *)(p))
+#  define simd_set1(c)    _mm_set1_epi8((char)(c))
+#  define simd_eq(a, b)   _mm_cmpeq_epi8((a), (b))
+#  define simd_gt(a, b)   _mm_cmpgt_epi8((a), (b))
+#  define simd_and(a, b)  _mm_and_si128((a), (b))
+#  define simd_or(a, b)   _mm_or_si128((a), (b))
+#  define simd_mask(v)    ((uint64_t)(uint32_t)_mm_movemask_epi8(v))
+#endif
+
+#ifdef PDJSON_SIMD_WIDTH
+#  define PDJSON_SIMD_ALL ((UINT64_C(1) << PDJSON_SIMD_WIDTH) - 1)
+/* Signed byte comparison: lo < v < hi */
+#  define simd_between(v, lo, hi) \
+    simd_and(simd_gt((v), simd_set1(lo)), simd_gt(simd_set1(hi), (v)))
+#endif
 
 #ifndef PDJSON_H
 #  include "pdjson.h"
@@ -137,6 +171,8 @@ static void init(json_stream *json)
     json->data.string = NULL;
     json->data.string_size = 0;
     json->data.string_fill = 0;
+    json->data.slice = NULL;
+    json->data.slice_len = 0;
     json->source.position = 0;
 
     json->alloc.malloc = malloc;
@@ -181,6 +217,7 @@ static int pushchar(json_stream *json, int c)
 static int init_string(json_stream *json)
 {
     json->data.string_fill = 0;
+    json->data.slice = NULL;
     if (json->data.string == NULL) {
         json->data.string_size = 1024;
         json->data.string = (char *)json->alloc.malloc(json->data.string_size);
@@ -490,9 +527,103 @@ read_utf8(json_stream* json, int next_char)
     return 0;
 }
 
+#ifdef PDJSON_SIMD_WIDTH
+/* Validates the string contents starting at @i in blocks, one mask bit per
+ * byte. Instead of decoding, the continuation bytes demanded by the lead
+ * bytes are compared with the ones present. Returns the position of the
+ * first byte which is left to the scalar code: the end of the string, an
+ * escape, the start of a block it can't decide or the end of the buffer. */
+static size_t
+scan_string_simd(const unsigned char *buf, size_t len, size_t i)
+{
+    uint64_t need = 0; /* Continuations demanded by the previous block */
+
+    while (len - i >= PDJSON_SIMD_WIDTH) {
+        simd_vec v = simd_load(buf + i);
+
+        uint64_t stop = simd_mask(simd_or(simd_or(simd_eq(v, simd_set1('"')),
+                                                  simd_eq(v, simd_set1('\\'))),
+                                          simd_between(v, -1, 0x20)));
+        uint64_t nonascii = simd_mask(v);
+        uint64_t cont = simd_mask(simd_gt(simd_set1(-64), v));       /* 80-BF */
+        uint64_t lead2 = simd_mask(simd_between(v, -63, -32));       /* C2-DF */
+        uint64_t lead3 = simd_mask(simd_between(v, -33, -16));       /* E0-EF */
+        uint64_t lead4 = simd_mask(simd_between(v, -17, -11));       /* F0-F4 */
+        uint64_t bad = nonascii & ~(cont | lead2 | lead3 | lead4);
+        /* These leads restrict the range of the following byte */
+        uint64_t special = simd_mask(simd_or(simd_or(simd_eq(v, simd_set1(0xE0)),
+                                                     simd_eq(v, simd_set1(0xED))),
+                                             simd_or(simd_eq(v, simd_set1(0xF0)),
+                                                     simd_eq(v, simd_set1(0xF4)))));
+
+        uint64_t req = need | lead2 << 1 | lead3 << 1 | lead3 << 2
+                       | lead4 << 1 | lead4 << 2 | lead4 << 3;
+        uint64_t valid = stop ? (stop & -stop) - 1 : PDJSON_SIMD_ALL;
+
+        if (((bad | special) & valid) || (req & valid) != (cont & valid))
+            break;
+        if (stop) {
+            if (req & ~valid)
+                break; /* Sequence cut short by the stop byte */
+            return i + (size_t)__builtin_ctzll(stop);
+        }
+
+        need = req >> PDJSON_SIMD_WIDTH;
+        i += PDJSON_SIMD_WIDTH;
+    }
+
+    /* Everything before i is valid, so back up to the start of a
+     * sequence that continues into the current block. */
+    if (need) {
+        while ((buf[i - 1] & 0xC0) == 0x80)
+            i--;
+        i--;
+    }
+    return i;
+}
+#endif
+
+/* For buffer sources: If the string starting at the current position needs
+ * no unescaping and is valid, refer to it in place instead of copying. */
+static int
+read_string_slice(json_stream *json)
+{
+    const unsigned char *buf = (const unsigned char *)json->source.source.buffer.buffer;
+    size_t len = json->source.source.buffer.length;
+    size_t start = json->source.position;
+    size_t i = start;
+
+#ifdef PDJSON_SIMD_WIDTH
+    i = scan_string_simd(buf, len, i);
+#endif
+    while (i < len) {
+        unsigned char c = buf[i];
+        if (c == '"') {
+            json->data.slice = (const char *)buf + start;
+            json->data.slice_len = i - start;
+            json->data.string_fill = 0;
+            json->source.position = i + 1;
+            return 0;
+        } else if (c == '\\' || c < 0x20) {
+            return -1;
+        } else if (c < 0x80) {
+            i++;
+        } else {
+            int count = utf8_seq_length(c);
+            if (!count || len - i < (size_t)count
+                || !is_legal_utf8(buf + i, count))
+                return -1;
+            i += count;
+        }
+    }
+    return -1;
+}
+
 static enum json_type
 read_string(json_stream *json)
 {
+    if (json->source.get == buffer_get && read_string_slice(json) == 0)
+        return JSON_STRING;
     if (init_string(json) != 0)
         return JSON_ERROR;
     while (1) {
@@ -638,10 +769,47 @@ json_isspace(int c)
     return false;
 }
 
+/* Skips whitespace of buffer sources in blocks */
+static void buffer_skip_space(json_stream *json)
+{
+    struct json_source *source = &json->source;
+    const unsigned char *buf = (const unsigned char *)source->source.buffer.buffer;
+    size_t len = source->source.buffer.length;
+
+    if (source->position >= len || !json_isspace(buf[source->position]))
+        return;
+#ifdef PDJSON_SIMD_WIDTH
+    while (len - source->position >= PDJSON_SIMD_WIDTH) {
+        simd_vec v = simd_load(buf + source->position);
+        uint64_t newline = simd_mask(simd_eq(v, simd_set1('\n')));
+        uint64_t space = newline
+                         | simd_mask(simd_or(simd_eq(v, simd_set1(' ')),
+                                             simd_or(simd_eq(v, simd_set1('\t')),
+                                                     simd_eq(v, simd_set1('\r')))));
+        if (space == PDJSON_SIMD_ALL) {
+            json->lineno += (size_t)__builtin_popcountll(newline);
+            source->position += PDJSON_SIMD_WIDTH;
+        } else {
+            size_t n = (size_t)__builtin_ctzll(~space);
+            json->lineno += (size_t)__builtin_popcountll(newline & ((UINT64_C(1) << n) - 1));
+            source->position += n;
+            return;
+        }
+    }
+#endif
+    while (source->position < len && json_isspace(buf[source->position])) {
+        if (buf[source->position] == '\n')
+            json->lineno++;
+        source->position++;
+    }
+}
+
 /* Returns the next non-whitespace character in the stream. */
 static int next(json_stream *json)
 {
    int c;
+   if (json->source.get == buffer_get)
+       buffer_skip_space(json);
    while (json_isspace(c = json->source.get(&json->source)))
        if (c == '\n')
            json->lineno++;
@@ -860,6 +1028,18 @@ enum json_type json_skip_until(json_stream *json, enum json_type type)
 
 char *json_get_string(json_stream *json, size_t *length)
 {
+    if (json->data.slice != NULL) {
+        /* Copy the slice, so the usual terminated string can be returned */
+        const char *slice = json->data.slice;
+        size_t slice_len = json->data.slice_len;
+        if (init_string(json) != 0)
+            return "";
+        for (size_t i = 0; i < slice_len; i++)
+            if (pushchar(json, slice[i]) != 0)
+                return "";
+        if (pushchar(json, '\0') != 0)
+            return "";
+    }
     if (length != NULL)
         *length = json->data.string_fill;
     if (json->data.string == NULL)
@@ -868,6 +1048,18 @@ char *json_get_string(json_stream *json, size_t *length)
         return json->data.string;
 }
 
+const char *json_get_slice(json_stream *json, size_t *length)
+{
+    if (json->data.slice != NULL) {
+        if (length != NULL)
+            *length = json->data.slice_len;
+        return json->data.slice;
+    }
+    if (length != NULL)
+        *length = json->data.string_fill > 0 ? json->data.string_fill - 1 : 0;
+    return json->data.string == NULL ? "" : json->data.string;
+}
+
 double json_get_number(json_stream *json)
 {
     char *p = json->data.string;
@@ -1,16 +1,99 @@
 #include <glib.h>
 #include "util.h"
+#include "audio.h"
+#include "stats.h"
 
-void
-play_audio(int len, char filepath[len])
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static void
+play_audio_ffplay(int len, char filepath[len])
 {
 	g_autofree char* cmd = g_strdup_printf("ffplay -nodisp -nostats -hide_banner -autoexit '%.*s'", len, filepath);
 
 	GError* error = NULL;
+	STATS_START(start);
 	g_spawn_command_line_sync(cmd, 0, 0, 0, &error);
+	STATS_STOP(STAT_AUDIO_SPAWN, start);
 	if (error)
 	{
 		error_msg("Failed to play file: %.*s. Error message: %s", len, filepath, error->message);
 		g_error_free(error);
 	}
 }
+
+void
+play_audio(int len, char filepath[len])
+{
+	if (audio_get_backend() == AUDIO_FFPLAY)
+	{
+		play_audio_ffplay(len, filepath);
+		return;
+	}
+
+	g_autofree char* path = g_strndup(filepath, (gsize)len);
+	pcm p = audio_decode(path);
+	audio_play(p);
+	pcm_free(&p);
+}
+
+#ifdef _WIN32
+char*
+map_file(const char* path, size_t* len)
+{
+	gchar* contents = 0;
+	gsize length = 0;
+	if (!g_file_get_contents(path, &contents, &length, NULL))
+		return NULL;
+	*len = length;
+	return contents;
+}
+
+void
+unmap_file(char* map, size_t len)
+{
+	g_free(map);
+}
+#else
+char*
+map_file(const char* path, size_t* len)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	*len = (size_t)st.st_size;
+	if (*len == 0)
+	{
+		close(fd);
+		return "";
+	}
+
+	char* map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	// The whole file is read front to back
+	posix_madvise(map, *len, POSIX_MADV_SEQUENTIAL);
+	return map;
+}
+
+void
+unmap_file(char* map, size_t len)
+{
+	if (len > 0)
+		munmap(map, len);
+}
+#endif
@@ -0,0 +1,502 @@
+/*
+ * Differential check of the SIMD code paths, see `make check`.
+ *
+ * Usage: jppron-check [-s | -v document | documents]
+ *
+ * Parses random documents as buffer sources and prints one digest of the
+ * token stream per document: types, values, line numbers, positions and
+ * errors. Builds with and without PDJSON_NO_SIMD have to print the same.
+ * The documents focus on what the block scanners decide: whitespace runs
+ * and strings crossing block boundaries, the E0, ED, F0 and F4 lead bytes,
+ * invalid UTF-8, escapes, control characters and truncated buffers.
+ *
+ * Then kata2hira_inplace(), which converts overlapping windows with SSE2,
+ * is compared with converting one character after another on random kana
+ * text, and has_katakana() with whether that changed anything. Last,
+ * deinflect() is run on words too long for its arena.
+ *
+ * -s exits with failure if the CPU lacks the instructions of the build,
+ * -v prints the document and the tokens of one document.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pdjson.h"
+#include "deinflector.h"
+#include "util.h"
+
+enum {
+    DEFAULT_DOCUMENTS = 100000,
+    KANA_TEXTS = 100000,
+    MAX_KANA_TEXT = 128,
+    MAX_DOCUMENT = 1 << 14,
+    MAX_DEPTH = 4,
+    MAX_DEINFLECT_WORD = 1 << 16,
+};
+
+typedef struct {
+    u8 buf[MAX_DOCUMENT];
+    size len;
+    u64 state;
+    bool invalid; // Whether errors are generated at all
+} document;
+
+/* splitmix64 */
+static u64
+next_random(u64 state[static 1])
+{
+    u64 z = (*state += 0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
+}
+
+static u32
+random_below(document* d, u32 n)
+{
+    return (u32)(next_random(&d->state) % n);
+}
+
+static u8
+random_between(document* d, u8 lo, u8 hi)
+{
+    return (u8)(lo + random_below(d, (u32)(hi - lo) + 1));
+}
+
+static void
+put(document* d, u8 c)
+{
+    if (d->len < MAX_DOCUMENT)
+	d->buf[d->len++] = c;
+}
+
+static void
+puts_(document* d, const char* s)
+{
+    while (*s)
+	put(d, (u8)*s++);
+}
+
+/*
+ * Up to 40 bytes, so that runs cover whole blocks of both widths
+ */
+static void
+gen_space(document* d)
+{
+    static const char space[] = " \t\n\r";
+    u32 n = random_below(d, 4) ? random_below(d, 3) : random_below(d, 41);
+    for (u32 i = 0; i < n; i++)
+	put(d, (u8)space[random_below(d, 4)]);
+}
+
+/*
+ * One UTF-8 sequence, valid unless the document is invalid. The leads that restrict the range of
+ * the next byte get both sides of their boundary.
+ */
+static void
+gen_multibyte(document* d)
+{
+    bool valid = !d->invalid || random_below(d, 16) != 0;
+    switch (random_below(d, 8))
+    {
+    case 0: // 2 bytes
+	put(d, random_between(d, 0xC2, 0xDF));
+	put(d, random_between(d, 0x80, 0xBF));
+	break;
+    case 1: // 3 bytes without restrictions, e.g. kana
+	put(d, random_below(d, 2) ? 0xE3 : random_between(d, 0xE1, 0xEC));
+	put(d, random_between(d, 0x80, 0xBF));
+	put(d, random_between(d, 0x80, 0xBF));
+	break;
+    case 2:
+	put(d, 0xE0);
+	put(d, valid ? random_between(d, 0xA0, 0xBF) : random_between(d, 0x80, 0x9F));
+	put(d, random_between(d, 0x80, 0xBF));
+	break;
+    case 3: // Surrogates are invalid
+	put(d, 0xED);
+	put(d, valid ? random_between(d, 0x80, 0x9F) : random_between(d, 0xA0, 0xBF));
+	put(d, random_between(d, 0x80, 0xBF));
+	break;
+    case 4:
+	put(d, 0xF0);
+	put(d, valid ? random_between(d, 0x90, 0xBF) : random_between(d, 0x80, 0x8F));
+	put(d, random_between(d, 0x80, 0xBF));
+	put(d, random_between(d, 0x80, 0xBF));
+	break;
+    case 5: // Above U+10FFFF is invalid
+	put(d, 0xF4);
+	put(d, valid ? random_between(d, 0x80, 0x8F) : random_between(d, 0x90, 0xBF));
+	put(d, random_between(d, 0x80, 0xBF));
+	put(d, random_between(d, 0x80, 0xBF));
+	break;
+    case 6:
+	put(d, random_between(d, 0xF1, 0xF3));
+	put(d, random_between(d, 0x80, 0xBF));
+	put(d, random_between(d, 0x80, 0xBF));
+	put(d, random_between(d, 0x80, 0xBF));
+	break;
+    default: // Invalid leads, stray or missing continuations
+	if (valid)
+	{
+	    put(d, random_between(d, 0xEE, 0xEF));
+	    put(d, random_between(d, 0x80, 0xBF));
+	    put(d, random_between(d, 0x80, 0xBF));
+	    break;
+	}
+	switch (random_below(d, 4))
+	{
+	case 0:
+	    put(d, random_below(d, 2) ? random_between(d, 0xC0, 0xC1) : random_between(d, 0xF5, 0xFF));
+	    break;
+	case 1:
+	    put(d, random_between(d, 0x80, 0xBF));
+	    break;
+	case 2:
+	    put(d, random_between(d, 0xE1, 0xEC));
+	    put(d, random_between(d, 0x80, 0xBF));
+	    break;
+	default:
+	    put(d, random_between(d, 0xF1, 0xF3));
+	    put(d, random_between(d, 0x80, 0xBF));
+	    put(d, random_between(d, 0x80, 0xBF));
+	    break;
+	}
+    }
+}
+
+static void
+gen_escape(document* d)
+{
+    static const char* const escapes[] = {
+	"\\n", "\\\"", "\\\\", "\\/", "\\t", "\\u00e9", "\\u30a2", "\\ud83d\\ude00",
+	"\\ud83d", "\\x", "\\u12", "\\",
+    };
+    // The invalid ones at the end
+    u32 n = countof(escapes);
+    puts_(d, escapes[random_below(d, d->invalid && random_below(d, 4) == 0 ? n : n - 4)]);
+}
+
+static void
+gen_string(document* d)
+{
+    put(d, '"');
+    u32 pieces = random_below(d, 12);
+    for (u32 i = 0; i < pieces; i++)
+    {
+	u32 kind = random_below(d, 32);
+	if (kind < 16)
+	{
+	    u32 n = random_below(d, 40);
+	    for (u32 k = 0; k < n; k++)
+	    {
+		u8 c = random_between(d, 0x20, 0x7E);
+		put(d, c == '"' || c == '\\' ? 'x' : c);
+	    }
+	}
+	else if (kind < 29)
+	    gen_multibyte(d);
+	else if (kind < 31 || !d->invalid)
+	    gen_escape(d);
+	else
+	    put(d, random_between(d, 0x00, 0x1F));
+    }
+    if (!d->invalid || random_below(d, 64))
+	put(d, '"');
+}
+
+static void gen_value(document* d, int depth);
+
+static void
+gen_object(document* d, int depth)
+{
+    put(d, '{');
+    u32 n = random_below(d, 8);
+    for (u32 i = 0; i < n; i++)
+    {
+	if (i)
+	    put(d, ',');
+	gen_space(d);
+	gen_string(d);
+	gen_space(d);
+	put(d, ':');
+	gen_value(d, depth + 1);
+	gen_space(d);
+    }
+    put(d, '}');
+}
+
+static void
+gen_array(document* d, int depth)
+{
+    put(d, '[');
+    u32 n = random_below(d, 8);
+    for (u32 i = 0; i < n; i++)
+    {
+	if (i)
+	    put(d, ',');
+	gen_value(d, depth + 1);
+	gen_space(d);
+    }
+    put(d, ']');
+}
+
+static void
+gen_value(document* d, int depth)
+{
+    gen_space(d);
+    switch (random_below(d, depth < MAX_DEPTH ? 7 : 4))
+    {
+    case 0:
+    case 1:
+	gen_string(d);
+	break;
+    case 2:
+	puts_(d, random_below(d, 2) ? "-12.5e3" : "42");
+	break;
+    case 3:
+	puts_(d, random_below(d, 2) ? "true" : "null");
+	break;
+    case 4:
+    case 5: // Most of an index.json
+	gen_object(d, depth);
+	break;
+    default:
+	gen_array(d, depth);
+	break;
+    }
+}
+
+static void
+gen_document(document* d, u64 seed)
+{
+    d->len = 0;
+    d->state = seed * 0xD1B54A32D192ED03;
+    d->invalid = random_below(d, 4) == 0;
+    gen_space(d);
+    gen_object(d, 0);
+    gen_space(d);
+    // Cut short, which ends strings at the end of the buffer
+    if (d->invalid && random_below(d, 2) == 0)
+	d->len = random_below(d, (u32)d->len + 1);
+}
+
+static u64
+fnv1a(u64 h, const void* p, size_t n)
+{
+    const u8* s = p;
+    for (size_t i = 0; i < n; i++)
+	h = (h ^ s[i]) * 0x100000001B3;
+    return h;
+}
+
+/*
+ * Returns: The digest of the token stream of @d, printing it if @verbose
+ */
+static u64
+parse_document(document* d, size tokens[static 1], bool verbose)
+{
+    json_stream s[1];
+    json_open_buffer(s, d->buf, (size_t)d->len);
+
+    u64 h = 0xCBF29CE484222325;
+    *tokens = 0;
+    for (;;)
+    {
+	enum json_type type = json_next(s);
+	size_t lineno = json_get_lineno(s), position = json_get_position(s);
+	h = fnv1a(h, &type, sizeof(type));
+	h = fnv1a(h, &lineno, sizeof(lineno));
+	h = fnv1a(h, &position, sizeof(position));
+
+	size_t len = 0;
+	const char* value = "";
+	if (type == JSON_STRING || type == JSON_NUMBER)
+	    value = json_get_slice(s, &len);
+	else if (type == JSON_ERROR)
+	{
+	    value = json_get_error(s);
+	    len = strlen(value);
+	}
+	h = fnv1a(h, &len, sizeof(len));
+	h = fnv1a(h, value, len);
+	(*tokens)++;
+
+	if (verbose)
+	    printf("%d line %zu pos %zu: %.*s\n", (int)type, lineno, position, (int)len, value);
+	if (type == JSON_DONE || type == JSON_ERROR)
+	    break;
+    }
+    json_close(s);
+    return h;
+}
+
+/*
+ * Text of whole characters, many of them around the katakana block
+ * (E3 82 A0 - E3 83 BF), followed by a few random bytes of that range
+ */
+static void
+gen_kana_text(document* d, u64 seed)
+{
+    static const u8 stray[] = { 0xE3, 0x80, 0x81, 0x82, 0x83, 0xA0, 0xA1, 0xB6, 0xB7, 0xBD, 0xBE, 0xBF, 'a' };
+    d->len = 0;
+    d->state = seed * 0xD1B54A32D192ED03;
+    u32 chars = random_below(d, MAX_KANA_TEXT / 3);
+    for (u32 i = 0; i < chars && d->len + 4 <= MAX_KANA_TEXT; i++)
+    {
+	u32 kind = random_below(d, 8);
+	if (kind < 4) // Katakana or the end of hiragana
+	{
+	    put(d, 0xE3);
+	    put(d, random_between(d, 0x82, 0x83));
+	    put(d, random_between(d, 0x80, 0xBF));
+	}
+	else if (kind < 6) // Hiragana, punctuation and kanji
+	{
+	    put(d, random_below(d, 2) ? 0xE3 : random_between(d, 0xE4, 0xE9));
+	    put(d, random_between(d, 0x80, 0x81));
+	    put(d, random_between(d, 0x80, 0xBF));
+	}
+	else if (kind < 7)
+	    put(d, random_between(d, 0x20, 0x7E));
+	else
+	    gen_multibyte(d);
+    }
+    for (u32 n = random_below(d, 4); n > 0 && d->len < MAX_KANA_TEXT; n--)
+	put(d, stray[random_below(d, countof(stray))]);
+}
+
+static void
+kata2hira_reference(u8* s, size len)
+{
+    for (size i = 0; i + 2 < len; i++)
+    {
+	if (s[i] != 0xE3 || (s[i + 1] & 0xC0) != 0x80 || (s[i + 2] & 0xC0) != 0x80)
+	    continue;
+	u32 cp = 0x3000 | (u32)(s[i + 1] & 0x3F) << 6 | (s[i + 2] & 0x3F);
+	if ((cp >= 0x30A1 && cp <= 0x30F6) || cp == 0x30FD || cp == 0x30FE)
+	{
+	    cp -= 0x60;
+	    s[i + 1] = (u8)(0x80 | (cp >> 6 & 0x3F));
+	    s[i + 2] = (u8)(0x80 | (cp & 0x3F));
+	}
+	i += 2;
+    }
+}
+
+/*
+ * Returns: The digest of the converted texts
+ */
+static u64
+check_kata2hira(document* d, u64 n)
+{
+    u8 text[MAX_KANA_TEXT + 16], expected[MAX_KANA_TEXT];
+    u64 h = 0xCBF29CE484222325;
+    for (u64 i = 0; i < n; i++)
+    {
+	gen_kana_text(d, i);
+	// Unaligned at every offset, with bytes after the end that must stay
+	size offset = (size)(i % 16);
+	memset(text, 0xE3, sizeof(text));
+	memcpy(text + offset, d->buf, (size_t)d->len);
+	memcpy(expected, d->buf, (size_t)d->len);
+	kata2hira_reference(expected, d->len);
+
+	s8 s = { .s = text + offset, .len = d->len };
+	bool changed = memcmp(expected, d->buf, (size_t)d->len) != 0;
+	if (has_katakana(s) != changed)
+	    fatal("has_katakana() differs on text %llu", (unsigned long long)i);
+	kata2hira_inplace(s);
+	if (memcmp(s.s, expected, (size_t)s.len) != 0 || s.s[s.len] != 0xE3)
+	    fatal("kata2hira_inplace() differs on text %llu", (unsigned long long)i);
+	h = fnv1a(h, s.s, (size_t)s.len);
+    }
+    return h;
+}
+
+/*
+ * Deinflects words of up to @maxlen bytes, repeating an inflected ending,
+ * in an arena of 64 KiB like the lookups use. Long words run out of arena
+ * long before MAX_CANDIDATES, which has to end the candidates instead of
+ * aborting.
+ *
+ * Returns: The total number of candidates
+ */
+static size
+check_deinflect_long(size maxlen)
+{
+    static const char ending[] = "させられなかった";
+    enum { ARENA = 1 << 16 };
+    u8* word = xmalloc((size_t)maxlen);
+    u8* mem = xmalloc(ARENA);
+    size total = 0;
+
+    for (size len = 0; len + (size)sizeof(ending) - 1 <= maxlen; len += (size)sizeof(ending) - 1)
+    {
+	memcpy(word + len, ending, sizeof(ending) - 1);
+	s8 w = { .s = word, .len = len + (size)sizeof(ending) - 1 };
+
+	arena a = { mem, mem + ARENA };
+	deinflections d = deinflect(w, &a);
+	if (d.len > 0 && !s8equals(d.items[0].word, w))
+	    fatal("deinflect() lost the word of %td bytes", w.len);
+	for (size i = 0; i < d.len; i++)
+	{
+	    if (d.items[i].word.len && (d.items[i].word.s < mem || d.items[i].word.s > a.beg))
+		fatal("deinflect() left the arena on a word of %td bytes", w.len);
+	}
+	total += d.len;
+    }
+
+    // Too small for the bookkeeping
+    arena a = { mem, mem + 1024 };
+    if (deinflect((s8){ .s = word, .len = maxlen }, &a).len != 0 || a.beg != mem)
+	fatal("deinflect() used an arena too small for it");
+
+    free(word);
+    free(mem);
+    return total;
+}
+
+static bool
+cpu_supported(void)
+{
+#if defined(__GNUC__) && defined(__AVX2__)
+    return __builtin_cpu_supports("avx2");
+#else
+    return true;
+#endif
+}
+
+int
+main(int argc, char** argv)
+{
+    static document d;
+    size tokens;
+
+    if (argc > 1 && strcmp(argv[1], "-s") == 0)
+	return cpu_supported() ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (argc > 2 && strcmp(argv[1], "-v") == 0)
+    {
+	gen_document(&d, strtoull(argv[2], 0, 10));
+	fwrite(d.buf, 1, (size_t)d.len, stdout);
+	puts("\n--");
+	parse_document(&d, &tokens, true);
+	return EXIT_SUCCESS;
+    }
+
+    u64 n = argc > 1 ? strtoull(argv[1], 0, 10) : DEFAULT_DOCUMENTS;
+    if (n == 0)
+	fatal("Usage: %s [-s | -v document | documents]", argv[0]);
+    for (u64 i = 0; i < n; i++)
+    {
+	gen_document(&d, i);
+	u64 h = parse_document(&d, &tokens, false);
+	printf("%llu %td %016llx\n", (unsigned long long)i, tokens, (unsigned long long)h);
+    }
+    printf("kata2hira %d %016llx\n", KANA_TEXTS, (unsigned long long)check_kata2hira(&d, KANA_TEXTS));
+    printf("deinflect %td\n", check_deinflect_long(MAX_DEINFLECT_WORD));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "util.h"
+#include "stats.h"
+
+#ifdef JPPRON_STATS
+static const char* const stat_names[STAT_COUNT] = {
+    [STAT_DB_OPEN] = "db_open",
+    [STAT_TXN_BEGIN] = "txn_begin",
+    [STAT_CURSOR_WALK] = "cursor_walk",
+    [STAT_RECORD_DECODE] = "record_decode",
+    [STAT_KATA2HIRA] = "kata2hira",
+    [STAT_KANJI2HIRA] = "kanji2hira",
+    [STAT_AUDIO_DECODE] = "audio_decode",
+    [STAT_AUDIO_SPAWN] = "audio_spawn",
+    [STAT_JSON_PARSE] = "json_parse",
+};
+
+static struct {
+    _Atomic u64 count;
+    _Atomic u64 total_ns;
+    _Atomic u64 max_ns;
+} counters[STAT_COUNT];
+#endif
+
+u64
+stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+void
+stats_add(stat_id id, u64 ns)
+{
+#ifdef JPPRON_STATS
+    atomic_fetch_add_explicit(&counters[id].count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[id].total_ns, ns, memory_order_relaxed);
+    u64 max = atomic_load_explicit(&counters[id].max_ns, memory_order_relaxed);
+    while (ns > max
+	   && !atomic_compare_exchange_weak_explicit(&counters[id].max_ns, &max, ns,
+						     memory_order_relaxed, memory_order_relaxed))
+	;
+#endif
+}
+
+stats_snapshot
+stats_get(void)
+{
+    stats_snapshot s = { 0 };
+#ifdef JPPRON_STATS
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+	s.c[i].count = atomic_load_explicit(&counters[i].count, memory_order_relaxed);
+	s.c[i].total_ns = atomic_load_explicit(&counters[i].total_ns, memory_order_relaxed);
+	s.c[i].max_ns = atomic_load_explicit(&counters[i].max_ns, memory_order_relaxed);
+    }
+#endif
+    return s;
+}
+
+void
+stats_print(const stats_snapshot* since, bool json)
+{
+#ifndef JPPRON_STATS
+    if (json)
+	printf("{\"enabled\":false}\n");
+    else
+	msg("jppron was built without stats. Rebuild it with STATS_FLAGS=-DJPPRON_STATS.");
+#else
+    stats_snapshot now = stats_get();
+    if (json)
+	printf("{\"enabled\":true");
+    else
+	printf("%-14s %8s %12s %12s %12s\n", "Phase", "Calls", "Total ms", "Mean us", "Max us");
+
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+	stat_counter c = now.c[i];
+	if (since)
+	{
+	    c.count -= since->c[i].count;
+	    c.total_ns -= since->c[i].total_ns;
+	    // An unchanged maximum may predate @since, which only bounds it
+	    if (c.max_ns == since->c[i].max_ns)
+		c.max_ns = c.total_ns < c.max_ns ? c.total_ns : c.max_ns;
+	}
+	double mean_us = c.count ? (double)c.total_ns / (double)c.count / 1e3 : 0;
+
+	if (json)
+	    printf(",\"%s\":{\"calls\":%llu,\"total_ms\":%.3f,\"mean_us\":%.3f,\"max_us\":%.3f}",
+		   stat_names[i], (unsigned long long)c.count, (double)c.total_ns / 1e6, mean_us,
+		   (double)c.max_ns / 1e3);
+	else
+	    printf("%-14s %8llu %12.3f %12.3f %12.3f\n", stat_names[i], (unsigned long long)c.count,
+		   (double)c.total_ns / 1e6, mean_us, (double)c.max_ns / 1e3);
+    }
+    if (json)
+	printf("}\n");
+#endif
+}
@@ -30,6 +30,28 @@ void* xrealloc(void* ptr, size_t nbytes)
     return p;
 }
 
+void*
+arena_tryalloc(arena* a, size objsize, size align, size count)
+{
+    size padding = -(uintptr_t)a->beg & (uintptr_t)(align - 1);
+    size available = a->end - a->beg - padding;
+    if (available < 0 || count > available / objsize)
+	return 0;
+
+    u8* p = a->beg + padding;
+    a->beg += padding + count * objsize;
+    return memset(p, 0, (size_t)(count * objsize));
+}
+
+void*
+arena_alloc(arena* a, size objsize, size align, size count)
+{
+    void* p = arena_tryalloc(a, objsize, align, count);
+    if (!p)
+	fatal("Arena exhausted.");
+    return p;
+}
+
 /* --------------- Start s8 utils -------------- */
 void
 u8copy(u8* dst, u8* src, size n)